@@ -14,7 +14,15 @@ Popup {
     onActivated: close()
   }
 
-  property ImageRef image: viewModelSimpleList[list.currentIndex]
+  // set when a related image is opened, cleared when the grid moves on
+  property ImageRef override: null
+  property ImageRef image: override ? override : viewModelSimpleList[list.currentIndex]
+  property var similarImages: image ? ImageDao.findSimilar(image.fileId, 12, similarSearchDistance) : []
+
+  Connections {
+    target: list
+    function onCurrentIndexChanged() { lightbox.override = null }
+  }
   
   parent: Overlay.overlay
   anchors.centerIn: Overlay.overlay
@@ -107,4 +115,30 @@ Popup {
       }
     }
   }
+
+  ListView {
+    anchors.left: parent.left
+    anchors.right: parent.right
+    anchors.bottom: parent.bottom
+    anchors.margins: 8
+    height: 96
+    spacing: 4
+    orientation: ListView.Horizontal
+    visible: count > 0
+    model: lightbox.similarImages
+
+    delegate: Image {
+      width: 96
+      height: 96
+      fillMode: Image.PreserveAspectCrop
+      asynchronous: true
+      sourceSize.width: 96
+      sourceSize.height: 96
+      source: "image://thumper/" + modelData.fileId
+
+      TapHandler {
+        onTapped: lightbox.override = modelData
+      }
+    }
+  }
 }
@@ -158,7 +158,7 @@ Popup {
         }
 
         Label {
-          text: "Images will be exported to %1".arg(thumper.resolveRelativePath(pathPrefix))
+          text: (/\.(tar|zip)$/i.test(pathPrefix) ? "Images will be archived to %1" : "Images will be exported to %1").arg(thumper.resolveRelativePath(pathPrefix))
         }
 
         RowLayout {
@@ -188,6 +188,12 @@ Popup {
           checked: renderFilenameToClipboard
           onClicked: renderFilenameToClipboard = checked
         }
+
+        Switch {
+          text: "Sync: only write new or changed images, remove deleted ones"
+          checked: renderSync
+          onClicked: renderSync = checked
+        }
       }
 
       ColumnLayout {
@@ -208,6 +214,7 @@ Popup {
               "<li>F: Enlarge focused image</li>" +
               "<li>A: Add (new) tag to selection</li>" +
               "<li>R: Export selection</li>" +
+              "<li>S: Show images similar to the focused image</li>" +
               "<li>Delete: Mark selection for removal</li>" +
               "<li>Insert: Keep selection</li>" +
               "</ul>"
@@ -223,8 +230,9 @@ Popup {
         Button {
           text: "Find duplicates"
           onClicked: {
-            var refList = ImageDao.findAllDuplicates(allSimpleList, maxDistance.value)
-            setViewList(refList)
+            ImageDao.findAllDuplicatesAsync(allSimpleList, maxDistance.value, duplicateSearchCascaded, function(refList) {
+              setViewList(refList)
+            })
           }
         }
         RowLayout {
@@ -241,6 +249,25 @@ Popup {
           }
         }
 
+        Switch {
+          text: "Confirm matches with difference and block hash"
+          checked: duplicateSearchCascaded
+          onClicked: duplicateSearchCascaded = checked
+        }
+
+        RowLayout {
+          Slider {
+            from: 0
+            to: 24
+            value: similarSearchDistance
+            stepSize: 1
+            onMoved: similarSearchDistance = value
+          }
+          Label {
+            text: "Similar image distance: %1".arg(similarSearchDistance)
+          }
+        }
+
         Button {
           text: "Clear thumbnail cache"
           onClicked: ImageDao.backgroundTask("clearThumbnailCache");
@@ -260,6 +287,16 @@ Popup {
           text: "Vacuum database"
           onClicked: ImageDao.backgroundTask("vacuum")
         }
+
+        Button {
+          text: "Compact database in the background"
+          onClicked: ImageDao.backgroundTask("compact")
+        }
+
+        Button {
+          text: ImageDao.contentHash === ImageDao.Xxh3_128 ? "Key images by SHA-256" : "Key images by XXH3-128 (faster import)"
+          onClicked: ImageDao.backgroundTask(ImageDao.contentHash === ImageDao.Xxh3_128 ? "useSha256Keys" : "useXxh3Keys")
+        }
       }
     }
   }
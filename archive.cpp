@@ -0,0 +1,356 @@
+#include "archive.h"
+
+#include <QDateTime>
+#include <QDebug>
+#include <QIODevice>
+
+#include <zlib.h>
+
+static quint16 readLE16(const uchar *p) {
+  return p[0] | (p[1] << 8);
+}
+
+static quint32 readLE32(const uchar *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((quint32)p[3] << 24);
+}
+
+static qint64 readOctal(const uchar *p, int length) {
+  qint64 value = 0;
+  for(int i = 0; i < length && p[i] != 0 && p[i] != ' '; i++) {
+    if(p[i] < '0' || p[i] > '7')
+      return -1;
+    value = value * 8 + (p[i] - '0');
+  }
+  return value;
+}
+
+static void writeLE16(uchar *p, quint16 value) {
+  p[0] = value;
+  p[1] = value >> 8;
+}
+
+static void writeLE32(uchar *p, quint32 value) {
+  writeLE16(p, value);
+  writeLE16(p + 2, value >> 16);
+}
+
+// Zero padded octal number followed by a NUL, as used in tar headers.
+static void writeOctal(char *p, int length, qint64 value) {
+  snprintf(p, length, "%0*llo", length - 1, (unsigned long long)value);
+}
+
+static QString readName(const uchar *p, int length) {
+  return QString::fromUtf8((const char *)p, qstrnlen((const char *)p, length));
+}
+
+bool isArchive(const QString &path)
+{
+  return path.endsWith(QStringLiteral(".tar"), Qt::CaseInsensitive) || path.endsWith(QStringLiteral(".zip"), Qt::CaseInsensitive);
+}
+
+QList<ArchiveEntry> readArchiveIndex(const QString &path, const uchar *data, qint64 size)
+{
+  if(path.endsWith(QStringLiteral(".zip"), Qt::CaseInsensitive)) {
+    return readZipIndex(data, size);
+  }
+  return readTarIndex(data, size);
+}
+
+QList<ArchiveEntry> readTarIndex(const uchar *data, qint64 size)
+{
+  QList<ArchiveEntry> entries;
+  QString longName;
+
+  qint64 pos = 0;
+  while(pos + 512 <= size) {
+    const uchar *header = data + pos;
+    if(header[0] == 0) {
+      // end of archive marker
+      break;
+    }
+
+    qint64 entrySize = readOctal(header + 124, 12);
+    if(entrySize < 0 || pos + 512 + entrySize > size) {
+      qWarning() << "Corrupt tar header at offset" << pos;
+      break;
+    }
+
+    char type = header[156];
+    qint64 dataOffset = pos + 512;
+
+    if(type == 'L') {
+      // GNU long name for the next entry
+      longName = readName(data + dataOffset, entrySize);
+    } else {
+      if(type == '0' || type == 0) {
+        QString name = longName;
+        if(name.isEmpty()) {
+          name = readName(header, 100);
+          if(memcmp(header + 257, "ustar", 5) == 0 && header[345] != 0) {
+            name = readName(header + 345, 155) + '/' + name;
+          }
+        }
+        entries.append({ name, dataOffset, entrySize });
+      }
+      longName.clear();
+    }
+
+    pos = dataOffset + (entrySize + 511) / 512 * 512;
+  }
+
+  return entries;
+}
+
+QList<ArchiveEntry> readZipIndex(const uchar *data, qint64 size)
+{
+  QList<ArchiveEntry> entries;
+
+  // Find the end of central directory record, it's followed by a comment of
+  // at most 64KB.
+  qint64 eocd = -1;
+  for(qint64 pos = size - 22; pos >= 0 && pos >= size - 22 - 65535; pos--) {
+    if(readLE32(data + pos) == 0x06054b50) {
+      eocd = pos;
+      break;
+    }
+  }
+
+  if(eocd < 0) {
+    qWarning("Zip end of central directory not found");
+    return entries;
+  }
+
+  int count = readLE16(data + eocd + 10);
+  qint64 pos = readLE32(data + eocd + 16);
+
+  for(int i = 0; i < count; i++) {
+    if(pos + 46 > size || readLE32(data + pos) != 0x02014b50) {
+      qWarning() << "Corrupt zip central directory at offset" << pos;
+      break;
+    }
+
+    const uchar *header = data + pos;
+    int method = readLE16(header + 10);
+    quint32 crc = readLE32(header + 16);
+    qint64 compressedSize = readLE32(header + 20);
+    qint64 uncompressedSize = readLE32(header + 24);
+    int nameLength = readLE16(header + 28);
+    int extraLength = readLE16(header + 30);
+    int commentLength = readLE16(header + 32);
+    qint64 localOffset = readLE32(header + 42);
+    if(pos + 46 + nameLength + extraLength + commentLength > size) {
+      qWarning() << "Corrupt zip central directory at offset" << pos;
+      break;
+    }
+    QString name = QString::fromUtf8((const char *)header + 46, nameLength);
+
+    pos += 46 + nameLength + extraLength + commentLength;
+
+    if(name.endsWith('/'))
+      continue;
+
+    if(method != 0 && method != 8) {
+      qWarning() << "Skipping zip member with unsupported compression" << name << method;
+      continue;
+    }
+
+    if(localOffset + 30 > size || readLE32(data + localOffset) != 0x04034b50) {
+      qWarning() << "Corrupt zip local header for" << name;
+      continue;
+    }
+
+    qint64 dataOffset = localOffset + 30 + readLE16(data + localOffset + 26) + readLE16(data + localOffset + 28);
+    if(dataOffset + compressedSize > size) {
+      qWarning() << "Truncated zip member" << name;
+      continue;
+    }
+
+    entries.append({ name, dataOffset, compressedSize, method == 8, uncompressedSize, crc });
+  }
+
+  return entries;
+}
+
+QByteArray inflateEntry(const uchar *data, const ArchiveEntry &entry)
+{
+  // the size comes from the central directory, don't trust it blindly
+  if(entry.inflatedSize > 1024 * 1024 * 1024) {
+    qWarning() << "Zip member too large" << entry.name << entry.inflatedSize;
+    return QByteArray();
+  }
+
+  QByteArray result(entry.inflatedSize, Qt::Uninitialized);
+
+  z_stream stream = {};
+  // negative window bits: raw deflate data without zlib header
+  if(inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+    qWarning() << "inflateInit2 failed";
+    return QByteArray();
+  }
+
+  stream.next_in = (Bytef *)(data + entry.offset);
+  stream.avail_in = entry.size;
+  stream.next_out = (Bytef *)result.data();
+  stream.avail_out = result.size();
+  int rc = inflate(&stream, Z_FINISH);
+  qint64 inflated = stream.total_out;
+  inflateEnd(&stream);
+
+  if(rc != Z_STREAM_END || inflated != entry.inflatedSize) {
+    qWarning() << "Corrupt zip member" << entry.name;
+    return QByteArray();
+  }
+
+  if(crc32_z(0, (const Bytef *)result.constData(), result.size()) != entry.crc) {
+    qWarning() << "CRC mismatch in zip member" << entry.name;
+    return QByteArray();
+  }
+
+  return result;
+}
+
+ArchiveWriter::ArchiveWriter(QIODevice *device, bool zip) : m_device(device), m_zip(zip)
+{
+  QDateTime now = QDateTime::currentDateTime();
+  m_mtime = now.toSecsSinceEpoch();
+  m_dosTime = (now.time().hour() << 11) | (now.time().minute() << 5) | (now.time().second() / 2);
+  m_dosDate = ((now.date().year() - 1980) << 9) | (now.date().month() << 5) | now.date().day();
+}
+
+bool ArchiveWriter::writeTarHeader(const QByteArray &name, qint64 size, char type)
+{
+  char header[512] = {};
+  memcpy(header, name.constData(), qMin<qsizetype>(name.size(), 100));
+  writeOctal(header + 100, 8, 0644);
+  writeOctal(header + 108, 8, 0);
+  writeOctal(header + 116, 8, 0);
+  writeOctal(header + 124, 12, size);
+  writeOctal(header + 136, 12, m_mtime);
+  header[156] = type;
+  memcpy(header + 257, "ustar", 6);
+  memcpy(header + 263, "00", 2);
+
+  // the checksum is calculated with its own field set to spaces
+  memset(header + 148, ' ', 8);
+  unsigned int checksum = 0;
+  for(uchar c : header) {
+    checksum += c;
+  }
+  snprintf(header + 148, 8, "%06o", checksum);
+
+  return m_device->write(header, sizeof header) == sizeof header;
+}
+
+bool ArchiveWriter::beginMember(const QString &name, qint64 size)
+{
+  QByteArray utf8Name = name.toUtf8();
+  m_memberSize = size;
+  m_memberWritten = 0;
+  m_crc = 0;
+
+  if(!m_zip) {
+    if(utf8Name.size() > 100) {
+      // GNU long name, the name is stored as the data of a separate member
+      QByteArray longName = utf8Name + '\0';
+      longName.append((512 - longName.size() % 512) % 512, '\0');
+      if(!writeTarHeader(QByteArrayLiteral("././@LongLink"), utf8Name.size() + 1, 'L') || m_device->write(longName) != longName.size())
+        return false;
+    }
+    return writeTarHeader(utf8Name, size, '0');
+  }
+
+  qint64 offset = m_device->pos();
+  if(size > 0xFFFFFFFF || offset > 0xFFFFFFFF || m_zipMembers.size() >= 0xFFFF) {
+    qWarning("Zip archive limits exceeded, use a tar archive instead");
+    return false;
+  }
+
+  uchar header[30] = {};
+  writeLE32(header, 0x04034b50);
+  writeLE16(header + 4, 20);
+  writeLE16(header + 6, 0x0800); // UTF-8 names
+  writeLE16(header + 10, m_dosTime);
+  writeLE16(header + 12, m_dosDate);
+  writeLE32(header + 18, size);
+  writeLE32(header + 22, size);
+  writeLE16(header + 26, utf8Name.size());
+
+  m_zipMembers.append({ utf8Name, 0, (quint32)size, (quint32)offset });
+  return m_device->write((const char *)header, sizeof header) == sizeof header && m_device->write(utf8Name) == utf8Name.size();
+}
+
+bool ArchiveWriter::write(const char *data, qint64 length)
+{
+  if(m_memberWritten + length > m_memberSize) {
+    qWarning("Archive member is larger than announced");
+    return false;
+  }
+
+  if(m_zip) {
+    m_crc = crc32_z(m_crc, (const Bytef *)data, length);
+  }
+  m_memberWritten += length;
+  return m_device->write(data, length) == length;
+}
+
+bool ArchiveWriter::endMember()
+{
+  if(m_memberWritten != m_memberSize) {
+    qWarning("Archive member is smaller than announced");
+    return false;
+  }
+
+  if(!m_zip) {
+    static const char padding[512] = {};
+    qint64 padSize = (512 - m_memberSize % 512) % 512;
+    return m_device->write(padding, padSize) == padSize;
+  }
+
+  ZipMember &member = m_zipMembers.last();
+  member.crc = m_crc;
+
+  uchar crc[4];
+  writeLE32(crc, m_crc);
+  qint64 end = m_device->pos();
+  return m_device->seek(member.offset + 14) && m_device->write((const char *)crc, 4) == 4 && m_device->seek(end);
+}
+
+bool ArchiveWriter::finish()
+{
+  if(!m_zip) {
+    static const char endMarker[1024] = {};
+    return m_device->write(endMarker, sizeof endMarker) == sizeof endMarker;
+  }
+
+  qint64 directoryOffset = m_device->pos();
+  for(const ZipMember &member : m_zipMembers) {
+    uchar header[46] = {};
+    writeLE32(header, 0x02014b50);
+    writeLE16(header + 4, 20);
+    writeLE16(header + 6, 20);
+    writeLE16(header + 8, 0x0800);
+    writeLE16(header + 12, m_dosTime);
+    writeLE16(header + 14, m_dosDate);
+    writeLE32(header + 16, member.crc);
+    writeLE32(header + 20, member.size);
+    writeLE32(header + 24, member.size);
+    writeLE16(header + 28, member.name.size());
+    writeLE32(header + 42, member.offset);
+    if(m_device->write((const char *)header, sizeof header) != sizeof header || m_device->write(member.name) != member.name.size())
+      return false;
+  }
+
+  qint64 directorySize = m_device->pos() - directoryOffset;
+  if(directoryOffset + directorySize > 0xFFFFFFFF) {
+    qWarning("Zip archive limits exceeded, use a tar archive instead");
+    return false;
+  }
+
+  uchar eocd[22] = {};
+  writeLE32(eocd, 0x06054b50);
+  writeLE16(eocd + 8, m_zipMembers.size());
+  writeLE16(eocd + 10, m_zipMembers.size());
+  writeLE32(eocd + 12, directorySize);
+  writeLE32(eocd + 16, directoryOffset);
+  return m_device->write((const char *)eocd, sizeof eocd) == sizeof eocd;
+}
@@ -0,0 +1,60 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <QString>
+#include <QList>
+#include <QByteArray>
+
+class QIODevice;
+
+// Location of a member inside a tar or zip archive, offset and size refer to
+// its raw bytes. Deflated zip members have to go through inflateEntry().
+struct ArchiveEntry {
+  QString name;
+  qint64 offset;
+  qint64 size;
+  bool deflated = false;
+  qint64 inflatedSize = 0;
+  quint32 crc = 0;
+};
+
+bool isArchive(const QString &path);
+QList<ArchiveEntry> readArchiveIndex(const QString &path, const uchar *data, qint64 size);
+QList<ArchiveEntry> readTarIndex(const uchar *data, qint64 size);
+QList<ArchiveEntry> readZipIndex(const uchar *data, qint64 size);
+// Returns an empty array if the member is corrupt.
+QByteArray inflateEntry(const uchar *data, const ArchiveEntry &entry);
+
+// Writes an uncompressed tar or a store-only zip archive one member at a
+// time. The size of a member is given up front and its data may be written
+// in pieces. Zip members get their CRC patched into the local header, so the
+// device has to be seekable. Archives beyond the zip32 limits need tar.
+class ArchiveWriter {
+  struct ZipMember {
+    QByteArray name;
+    quint32 crc;
+    quint32 size;
+    quint32 offset;
+  };
+
+  QIODevice *m_device;
+  bool m_zip;
+  qint64 m_mtime;
+  quint16 m_dosTime;
+  quint16 m_dosDate;
+  QList<ZipMember> m_zipMembers;
+  qint64 m_memberSize = 0;
+  qint64 m_memberWritten = 0;
+  quint32 m_crc = 0;
+
+  bool writeTarHeader(const QByteArray &name, qint64 size, char type);
+public:
+  ArchiveWriter(QIODevice *device, bool zip);
+
+  bool beginMember(const QString &name, qint64 size);
+  bool write(const char *data, qint64 length);
+  bool endMember();
+  bool finish();
+};
+
+#endif // ARCHIVE_H
@@ -0,0 +1,195 @@
+#include "batchmode.h"
+#include "imagedao.h"
+#include "imagemetadata.h"
+#include "imageref.h"
+
+#include <QAtomicInteger>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMutex>
+#include <QThreadPool>
+
+static QElapsedTimer batchTimer;
+static QString batchCommand;
+static QBasicMutex outputMutex;
+
+static void writeEvent(const QString &event, QJsonObject obj = {})
+{
+  obj.insert(QStringLiteral("event"), event);
+  obj.insert(QStringLiteral("command"), batchCommand);
+  obj.insert(QStringLiteral("elapsedMs"), batchTimer.elapsed());
+  QByteArray line = QJsonDocument(obj).toJson(QJsonDocument::Compact);
+  line.append('\n');
+
+  QMutexLocker lock(&outputMutex);
+  fwrite(line.constData(), 1, line.size(), stdout);
+  fflush(stdout);
+}
+
+static void writeProgress(qint64 done, qint64 total)
+{
+  static QElapsedTimer throttle;
+  if(total > 0 && (done == total || !throttle.isValid() || throttle.elapsed() >= 250)) {
+    throttle.start();
+    writeEvent(QStringLiteral("progress"), { { "done", done }, { "total", total } });
+  }
+}
+
+static int usage()
+{
+  fprintf(stderr,
+          "Usage: thumper --batch <database> <command> [arguments]\n"
+          "\n"
+          "Commands:\n"
+          "  import <path>...              import files, directories and tar/zip archives\n"
+          "  rehash                        recompute metadata and perceptual hashes\n"
+          "  thumbnails [size]             pre-generate thumbnails (default 320)\n"
+          "  duplicates [distance] [cascaded]\n"
+          "                                report groups of similar images (default 5)\n"
+          "  export <directory> [size] [sync]\n"
+          "                                write all images, scaled to fit size if given,\n"
+          "                                sync skips unchanged files and removes deleted ones,\n"
+          "                                a .tar or .zip path writes a single archive\n"
+          "  compact                       purge deleted images and vacuum\n");
+  return 2;
+}
+
+static int batchImport(QCoreApplication &app, ImageDao *dao, const QStringList &paths)
+{
+  if(paths.isEmpty())
+    return usage();
+
+  QObject::connect(dao, &ImageDao::importProgress, dao, &writeProgress);
+  QObject::connect(dao, &ImageDao::importFinished, dao, [&app](qint64 imported, qint64 skipped, qint64 failed) {
+    writeEvent(QStringLiteral("finished"), { { "imported", imported }, { "skipped", skipped }, { "failed", failed } });
+    app.exit(failed > 0 ? 1 : 0);
+  });
+
+  if(!dao->importPaths(paths))
+    return 1;
+
+  return app.exec();
+}
+
+// Runs writer tasks one after another.
+static int batchTasks(QCoreApplication &app, ImageDao *dao, QStringList tasks)
+{
+  QObject::connect(dao, &ImageDao::taskProgress, dao, &writeProgress);
+  QObject::connect(dao, &ImageDao::taskFinished, dao, [&app, dao, &tasks](const QString &name) {
+    writeEvent(QStringLiteral("taskFinished"), { { "task", name } });
+    if(tasks.isEmpty()) {
+      writeEvent(QStringLiteral("finished"));
+      app.exit(0);
+    } else {
+      dao->backgroundTask(tasks.takeFirst());
+    }
+  });
+
+  dao->backgroundTask(tasks.takeFirst());
+  return app.exec();
+}
+
+static int batchThumbnails(ImageDao *dao, int size)
+{
+  QList<QObject *> refs = dao->all(false);
+  QAtomicInteger<qint64> done;
+  volatile bool cancelled = false;
+
+  QThreadPool pool;
+  for(QObject *obj : refs) {
+    qint64 id = static_cast<ImageRef *>(obj)->m_fileId;
+    pool.start([dao, id, size, &done, &cancelled]() {
+      dao->requestImage(id, QSize(size, size), &cancelled);
+      done.fetchAndAddRelaxed(1);
+    });
+  }
+
+  while(!pool.waitForDone(250)) {
+    writeProgress(done.loadRelaxed(), refs.size());
+  }
+
+  dao->sync();
+  writeProgress(refs.size(), refs.size());
+  writeEvent(QStringLiteral("finished"), { { "images", refs.size() }, { "size", size } });
+  return 0;
+}
+
+static int batchDuplicates(ImageDao *dao, int maxDistance, bool cascaded)
+{
+  auto groups = findDuplicateGroups(dao->all(false), maxDistance, cascaded);
+  for(const auto &group : groups) {
+    QJsonArray ids;
+    for(QObject *obj : group) {
+      ids.append(static_cast<ImageRef *>(obj)->m_fileId);
+    }
+    writeEvent(QStringLiteral("duplicates"), { { "ids", ids } });
+  }
+
+  writeEvent(QStringLiteral("finished"), { { "groups", groups.size() } });
+  return 0;
+}
+
+static int batchExport(QCoreApplication &app, ImageDao *dao, const QString &path, int size, bool sync)
+{
+  QList<QObject *> refs = dao->all(false);
+
+  QObject::connect(dao, &ImageDao::taskProgress, dao, &writeProgress);
+  QObject::connect(dao, &ImageDao::exportFinished, dao, [&app, dao, &refs](qint64 written, qint64 failed) {
+    // commits the export manifest
+    dao->sync();
+    writeEvent(QStringLiteral("finished"), { { "images", refs.size() }, { "written", written }, { "failed", failed } });
+    app.exit(failed > 0 ? 1 : 0);
+  });
+
+  dao->renderImages(refs, QFileInfo(path).absoluteFilePath(), size, sync ? ImageDao::SYNC_EXPORT : 0);
+  return app.exec();
+}
+
+static int runCommand(QCoreApplication &app, ImageDao *dao, const QStringList &params)
+{
+  if(batchCommand == QStringLiteral("import")) {
+    return batchImport(app, dao, params);
+  } else if(batchCommand == QStringLiteral("rehash")) {
+    return batchTasks(app, dao, { QStringLiteral("fixImageMetaData") });
+  } else if(batchCommand == QStringLiteral("thumbnails")) {
+    return batchThumbnails(dao, params.value(0, QStringLiteral("320")).toInt());
+  } else if(batchCommand == QStringLiteral("duplicates")) {
+    return batchDuplicates(dao, params.value(0, QStringLiteral("5")).toInt(), params.contains(QStringLiteral("cascaded")));
+  } else if(batchCommand == QStringLiteral("export")) {
+    if(params.isEmpty())
+      return usage();
+    return batchExport(app, dao, params.at(0), params.value(1, QStringLiteral("-1")).toInt(), params.contains(QStringLiteral("sync")));
+  } else if(batchCommand == QStringLiteral("compact")) {
+    return batchTasks(app, dao, { QStringLiteral("purgeDeletedImages"), QStringLiteral("vacuum") });
+  }
+
+  return usage();
+}
+
+int runBatch(int argc, char *argv[])
+{
+  QCoreApplication app(argc, argv);
+  batchTimer.start();
+
+  QStringList args = app.arguments();
+  if(args.size() < 4)
+    return usage();
+
+  QString dbname = QFileInfo(args.at(2)).absoluteFilePath();
+  batchCommand = args.at(3);
+  QStringList params = args.mid(4);
+
+  ImageDao::setDatabaseFilename(dbname);
+  ImageDao *dao = ImageDao::instance();
+  writeEvent(QStringLiteral("start"), { { "database", dbname }, { "arguments", QJsonArray::fromStringList(params) } });
+
+  int result = runCommand(app, dao, params);
+
+  // commits pending writes and stops the writer and worker threads
+  delete dao;
+  return result;
+}
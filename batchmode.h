@@ -0,0 +1,11 @@
+#ifndef BATCHMODE_H
+#define BATCHMODE_H
+
+// Runs a single maintenance command without the GUI:
+//
+//   thumper --batch <database> <command> [arguments]
+//
+// Progress and results are written to stdout as JSON, one object per line.
+int runBatch(int argc, char *argv[]);
+
+#endif // BATCHMODE_H
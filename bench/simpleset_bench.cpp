@@ -0,0 +1,98 @@
+// Compares SimpleMap with std::unordered_map and QHash on the key patterns the
+// application uses: random 64 bit keys (content and perceptual hashes) and
+// sequential image ids (the ImageRef map and the exporter's id sets). Not
+// built by default:
+//
+//   cmake --build build --target simpleset_bench
+//   build/simpleset_bench
+
+#include "../simpleset.h"
+
+#include <QHash>
+#include <QElapsedTimer>
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+using StdMap = std::unordered_map<uint64_t, void *>;
+using QtMap = QHash<quint64, void *>;
+
+static void put(SimpleMap<void *> &map, uint64_t key, void *value) { map.insert(key, value); }
+static void put(StdMap &map, uint64_t key, void *value) { map[key] = value; }
+static void put(QtMap &map, uint64_t key, void *value) { map.insert(key, value); }
+
+static void *get(const SimpleMap<void *> &map, uint64_t key) { return map.value(key, nullptr); }
+static void *get(const StdMap &map, uint64_t key) {
+  auto it = map.find(key);
+  return it == map.end() ? nullptr : it->second;
+}
+static void *get(const QtMap &map, uint64_t key) { return map.value(key, nullptr); }
+
+static double nsPerOp(const QElapsedTimer &timer, size_t count) {
+  return (double)timer.nsecsElapsed() / count;
+}
+
+// Prints ns per insert, hit and miss. The sum keeps the lookups alive.
+template <typename Map>
+static void run(const char *name, const std::vector<uint64_t> &keys, const std::vector<uint64_t> &hits, const std::vector<uint64_t> &misses)
+{
+  QElapsedTimer timer;
+  uintptr_t sum = 0;
+
+  timer.start();
+  Map map;
+  for(uint64_t key : keys) {
+    put(map, key, (void *)(uintptr_t)(key | 1));
+  }
+  double insert = nsPerOp(timer, keys.size());
+
+  timer.start();
+  for(uint64_t key : hits) {
+    sum += (uintptr_t)get(map, key);
+  }
+  double hit = nsPerOp(timer, hits.size());
+
+  timer.start();
+  for(uint64_t key : misses) {
+    sum += (uintptr_t)get(map, key);
+  }
+  double miss = nsPerOp(timer, misses.size());
+
+  printf("  %-20s insert %6.1f  hit %6.1f  miss %6.1f  (%zx)\n", name, insert, hit, miss, (size_t)(sum & 0xF));
+}
+
+static void runAll(const char *title, const std::vector<uint64_t> &keys, const std::vector<uint64_t> &misses)
+{
+  std::vector<uint64_t> hits = keys;
+  std::shuffle(hits.begin(), hits.end(), std::mt19937_64(2));
+
+  printf("%s, %zu keys, ns per operation\n", title, keys.size());
+  run<SimpleMap<void *>>("SimpleMap", keys, hits, misses);
+  run<StdMap>("std::unordered_map", keys, hits, misses);
+  run<QtMap>("QHash", keys, hits, misses);
+}
+
+int main()
+{
+  for(size_t count : { (size_t)100000, (size_t)1000000 }) {
+    std::mt19937_64 rng(1);
+
+    std::vector<uint64_t> random(count), randomMisses(count);
+    for(size_t i = 0; i < count; i++) {
+      random[i] = rng();
+      randomMisses[i] = rng();
+    }
+    runAll("Random keys", random, randomMisses);
+
+    std::vector<uint64_t> ids(count), idMisses(count);
+    for(size_t i = 0; i < count; i++) {
+      ids[i] = i + 1;
+      idMisses[i] = count + i + 1;
+    }
+    runAll("Sequential ids", ids, idMisses);
+  }
+  return 0;
+}
@@ -1,8 +1,14 @@
 #include "imagedao.h"
 #include "sqlite3.h"
 #include "sqlitehelper.h"
+#include "sqlitephash.h"
 #include "imagemetadata.h"
 
+#define XXH_INLINE_ALL
+#include "xxhash.h"
+
+#include <algorithm>
+#include <iterator>
 #include <set>
 #include <unordered_set>
 #include <unordered_map>
@@ -17,15 +23,24 @@
 #include <QFile>
 #include <QPainter>
 #include <QClipboard>
+#include <QJsonArray>
+#include <QJsonDocument>
 #include <QGuiApplication>
 #include <QDataStream>
 #include <QThreadPool>
 #include <QCryptographicHash>
 #include <QPainter>
 #include <QDir>
+#include <QFileInfo>
+#include <QPromise>
+#include <QJSEngine>
 
 ImageDao *ImageDao::m_instance;
 QString ImageDao::m_databaseFilename = QStringLiteral("default.imgdb");
+QAtomicInt ImageDao::m_contentHash = ImageDao::Sha256;
+
+static const QString contentHashKey = QStringLiteral("contentHash");
+static const QString xxh3KeyName = QStringLiteral("xxh3-128");
 
 #define EXEC(sql) \
 do { \
@@ -36,24 +51,38 @@ do { \
 ImageDao::ImageDao(QObject *parent) :
   QObject(parent),
   m_connPool(m_databaseFilename, SQLITE_OPEN_PRIVATECACHE | SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE),
-  m_conn(m_connPool.open())
+  m_conn(m_connPool.open()),
+  m_ingest(&m_connPool)
 {
-  qRegisterMetaType<ImageRenderContext>();
   qRegisterMetaType<QImage::Format>();
 
+  m_readerPool.setMaxThreadCount(4);
+
   auto idfw = new ImageDaoDeferredWriter(m_connPool.open());
+  m_writer = idfw;
   connect(this, &ImageDao::deferredBackgroundTask, idfw, &ImageDaoDeferredWriter::backgroundTask);
-  connect(this, &ImageDao::deferredAddTag, idfw, &ImageDaoDeferredWriter::addTag);
-  connect(this, &ImageDao::deferredRemoveTag, idfw, &ImageDaoDeferredWriter::removeTag);
-  connect(this, &ImageDao::deferredUpdateDeleted, idfw, &ImageDaoDeferredWriter::updateDeleted);
-  connect(this, &ImageDao::deferredWriteImage, idfw, &ImageDaoDeferredWriter::writeImage);
-  connect(this, &ImageDao::deferredRenderImages, idfw, &ImageDaoDeferredWriter::renderImages);
-  connect(this, &ImageDao::deferredCompressImages, idfw, &ImageDaoDeferredWriter::compressImages);
+  connect(&m_ingest, &ImageIngestPipeline::prepared, idfw, [idfw](const IngestItem &item) {
+    idfw->submit(WritePriority::Ingest, item);
+  }, Qt::DirectConnection);
+  connect(idfw, &ImageDaoDeferredWriter::ingestCommitted, &m_ingest, &ImageIngestPipeline::release, Qt::DirectConnection);
+  connect(idfw, &ImageDaoDeferredWriter::ingestRateChanged, this, &ImageDao::setIngestRate);
+  connect(idfw, &ImageDaoDeferredWriter::commitStatsChanged, this, &ImageDao::setCommitStats);
+  connect(idfw, &ImageDaoDeferredWriter::checkpointStatsChanged, this, &ImageDao::setCheckpointStats);
+  connect(idfw, &ImageDaoDeferredWriter::imagesPurged, &m_ingest, &ImageIngestPipeline::invalidateKnownHashes, Qt::DirectConnection);
+  connect(idfw, &ImageDaoDeferredWriter::keysRewritten, &m_ingest, &ImageIngestPipeline::invalidateKnownHashes, Qt::DirectConnection);
+  connect(idfw, &ImageDaoDeferredWriter::contentHashChanged, this, &ImageDao::contentHashChanged);
   connect(idfw, &ImageDaoDeferredWriter::updateImageData, this, &ImageDao::updateImageData);
   connect(idfw, &ImageDaoDeferredWriter::busyChanged, this, &ImageDao::setBusy);
+  connect(idfw, &ImageDaoDeferredWriter::progressChanged, this, &ImageDao::setProgress);
+  connect(idfw, &ImageDaoDeferredWriter::progressChanged, this, &ImageDao::taskProgress);
+  connect(idfw, &ImageDaoDeferredWriter::taskStatusChanged, this, &ImageDao::setTaskStatus);
+  connect(idfw, &ImageDaoDeferredWriter::taskFinished, this, &ImageDao::taskFinished);
   connect(idfw, &ImageDaoDeferredWriter::writeComplete, this, &ImageDao::writeComplete);
-  connect(idfw, &ImageDaoDeferredWriter::setClipboard, this, &ImageDao::setClipboard);
+  connect(idfw, &ImageDaoDeferredWriter::compactedCopyReady, this, &ImageDao::replaceDatabase);
+  connect(this, &ImageDao::databaseReplaced, idfw, &ImageDaoDeferredWriter::resumeAfterReplace);
 
+  connect(&m_writeThread, &QThread::started, idfw, &ImageDaoDeferredWriter::startCheckpoints);
+  connect(&m_writeThread, &QThread::started, idfw, &ImageDaoDeferredWriter::startCommitStats);
   connect(&m_writeThread, &QThread::finished, idfw, &QObject::deleteLater);
   idfw->moveToThread(&m_writeThread);
   m_writeThread.start();
@@ -61,6 +90,9 @@ ImageDao::ImageDao(QObject *parent) :
   int version;
 
   EXEC("PRAGMA journal_mode = WAL");
+  // Applies right away to a new database, existing ones are converted by the
+  // next vacuum.
+  EXEC("PRAGMA auto_vacuum = INCREMENTAL");
 
   EXEC("BEGIN");
 
@@ -80,7 +112,7 @@ ImageDao::ImageDao(QObject *parent) :
   if(version < 1) {
     qInfo("Upgrading database format to 1");
     EXEC("CREATE TABLE meta (key TEXT PRIMARY KEY, type TEXT, value TEXT)");
-    metaPut(QStringLiteral("version"), version = 1);
+    metaPut(m_conn, QStringLiteral("version"), version = 1);
   }
 
   if(version < 2) {
@@ -88,13 +120,13 @@ ImageDao::ImageDao(QObject *parent) :
     EXEC("ALTER TABLE store ADD COLUMN width INTEGER");
     EXEC("ALTER TABLE store ADD COLUMN height INTEGER");
     EXEC("ALTER TABLE store ADD COLUMN origin_url TEXT");
-    metaPut(QStringLiteral("version"), version = 2);
+    metaPut(m_conn, QStringLiteral("version"), version = 2);
   }
 
   if(version < 3) {
     qInfo("Upgrading database format to 3");
     EXEC("ALTER TABLE store ADD COLUMN phash INTEGER");
-    metaPut(QStringLiteral("version"), version = 3);
+    metaPut(m_conn, QStringLiteral("version"), version = 3);
   }
 
   if(version < 4) {
@@ -107,14 +139,14 @@ ImageDao::ImageDao(QObject *parent) :
     EXEC("DROP TABLE store");
     EXEC("ALTER TABLE new_store RENAME TO store");
 
-    metaPut(QStringLiteral("version"), version = 4);
+    metaPut(m_conn, QStringLiteral("version"), version = 4);
   }
 
   if(version < 5) {
     qInfo("Upgrading database format to 5");
     EXEC("ALTER TABLE image ADD COLUMN deleted INTEGER");
 
-    metaPut(QStringLiteral("version"), version = 5);
+    metaPut(m_conn, QStringLiteral("version"), version = 5);
   }
 
   if(version < 11) {
@@ -125,22 +157,69 @@ ImageDao::ImageDao(QObject *parent) :
     EXEC("CREATE TABLE IF NOT EXISTS thumb160 (id INTEGER PRIMARY KEY, image BLOB)");
     EXEC("CREATE TABLE IF NOT EXISTS thumb80 (id INTEGER PRIMARY KEY, image BLOB)");
     EXEC("CREATE TABLE IF NOT EXISTS thumb40 (id INTEGER PRIMARY KEY, image BLOB)");
-    metaPut(QStringLiteral("version"), version = 11);
+    metaPut(m_conn, QStringLiteral("version"), version = 11);
   }
 
   if(version < 12) {
     qInfo("Upgrading database format to 12");
     EXEC("ALTER TABLE image ADD COLUMN format TEXT");
-    metaPut(QStringLiteral("version"), version = 12);
+    metaPut(m_conn, QStringLiteral("version"), version = 12);
   }
 
   if(version < 13) {
     qInfo("Upgrading database format to 13");
     EXEC("ALTER TABLE image ADD COLUMN filesize INTEGER");
     EXEC("ALTER TABLE image ADD COLUMN pixelformat INTEGER");
-    metaPut(QStringLiteral("version"), version = 13);
+    metaPut(m_conn, QStringLiteral("version"), version = 13);
+  }
+
+  if(version < 14) {
+    qInfo("Upgrading database format to 14");
+    EXEC("ALTER TABLE image ADD COLUMN dhash INTEGER");
+    EXEC("ALTER TABLE image ADD COLUMN bhash INTEGER");
+    metaPut(m_conn, QStringLiteral("version"), version = 14);
+  }
+
+  if(version < 15) {
+    qInfo("Upgrading database format to 15");
+    EXEC("CREATE INDEX image_origin_url ON image (origin_url)");
+    metaPut(m_conn, QStringLiteral("version"), version = 15);
+  }
+
+  if(version < 16) {
+    qInfo("Upgrading database format to 16");
+    // SQLite has no unhex(), the hashes are converted to blobs here.
+    EXEC("CREATE TABLE new_store (id INTEGER PRIMARY KEY, hash BLOB UNIQUE, image BLOB)");
+    {
+      auto ps_select = m_conn.prepare("SELECT id, hash FROM store");
+      auto ps_insert = m_conn.prepare("INSERT INTO new_store (id, hash, image) SELECT id, ?2, image FROM store WHERE id = ?1");
+      while(ps_select.step(SRC_LOCATION)) {
+        ps_insert.bind(1, ps_select.resultInteger(0));
+        ps_insert.bind(2, QByteArray::fromHex(ps_select.resultString(1).toLatin1()));
+        ps_insert.exec(SRC_LOCATION);
+      }
+    }
+    EXEC("DROP TABLE store");
+    EXEC("ALTER TABLE new_store RENAME TO store");
+    metaPut(m_conn, QStringLiteral("version"), version = 16);
+  }
+
+  if(version < 17) {
+    qInfo("Upgrading database format to 17");
+    EXEC("CREATE TABLE export_manifest (path TEXT, id INTEGER, hash BLOB, size INTEGER, flags INTEGER, filename TEXT, PRIMARY KEY (path, id))");
+    metaPut(m_conn, QStringLiteral("version"), version = 17);
   }
 
+  if(version < 18) {
+    qInfo("Upgrading database format to 18");
+    // SHA-256 of the image when the hash column holds an XXH3-128 key.
+    EXEC("ALTER TABLE store ADD COLUMN sha256 BLOB");
+    metaPut(m_conn, QStringLiteral("version"), version = 18);
+  }
+
+  setContentHash(metaGet(m_conn, contentHashKey).toString() == xxh3KeyName ? Xxh3_128 : Sha256);
+  qInfo("Content hash: %s", contentHash() == Xxh3_128 ? "XXH3-128" : "SHA-256");
+
   EXEC("COMMIT");
   return;
 
@@ -153,8 +232,26 @@ error:
 
 ImageDao::~ImageDao()
 {
+  emit aboutToShutDown();
+  if(m_importer) {
+    m_importer->cancel();
+    m_importer->thread()->wait();
+  }
+  if(m_exporter) {
+    m_exporter->cancel();
+    m_exporter->thread()->wait();
+  }
+  // Workers still hand prepared items to the writer, keep it running until
+  // the pool is empty.
+  m_ingest.waitForDone();
+  m_readerPool.waitForDone();
+  sync();
   m_writeThread.quit();
   m_writeThread.wait();
+
+  if(m_instance == this) {
+    m_instance = nullptr;
+  }
   qInfo(SRC_LOCATION);
 }
 
@@ -172,13 +269,22 @@ void ImageDao::setDatabaseFilename(const QString &filename)
 
 void ImageDao::metaPut(const QString &key, const QVariant &val)
 {
-  QMutexLocker writeLock(m_conn.writeLock());
-  auto ps = m_conn.prepare("INSERT OR REPLACE INTO meta (key, type, value) VALUES (?1, ?2, ?3)");
+  m_writer->submit(WritePriority::UserEdit, MetaPutCommand { key, val });
+}
+
+QVariant ImageDao::metaGet(const QString &key)
+{
+  return metaGet(m_conn, key);
+}
+
+void ImageDao::metaPut(const SQLiteConnection &conn, const QString &key, const QVariant &val)
+{
+  auto ps = conn.prepare("INSERT OR REPLACE INTO meta (key, type, value) VALUES (?1, ?2, ?3)");
   ps.bind(1, key);
 
   sqlite3_bind_text(ps.m_stmt, 2, val.typeName(), -1, nullptr);
-  if(val.type() == QVariant::Int) {
-    ps.bind(3, val.toInt());
+  if(val.type() == QVariant::Int || val.type() == QVariant::LongLong) {
+    ps.bind(3, val.toLongLong());
   } else if(val.type() == QVariant::String) {
     ps.bind(3, val.toString());
   } else {
@@ -190,16 +296,16 @@ void ImageDao::metaPut(const QString &key, const QVariant &val)
   ps.step(SRC_LOCATION);
 }
 
-QVariant ImageDao::metaGet(const QString &key)
+QVariant ImageDao::metaGet(const SQLiteConnection &conn, const QString &key)
 {
   QVariant result;
 
-  auto ps = m_conn.prepare("SELECT type, value FROM meta WHERE key = ?1");
+  auto ps = conn.prepare("SELECT type, value FROM meta WHERE key = ?1");
   ps.bind(1, key);
   if(ps.step(SRC_LOCATION)) {
     const char *typeName = (const char *)sqlite3_column_text(ps.m_stmt, 0);
     QVariant::Type type = QVariant::nameToType(typeName);
-    if(type == QVariant::Int) {
+    if(type == QVariant::Int || type == QVariant::LongLong) {
       result = ps.resultInteger(1);
     } else if(type == QVariant::String) {
       result = ps.resultString(1);
@@ -216,51 +322,160 @@ QVariant ImageDao::metaGet(const QString &key)
   return result;
 }
 
-QList<QObject *> ImageDao::addTag(const QList<QObject *> &irefs, const QString &tag)
+static QList<qint64> fileIds(const QList<QObject *> &irefs)
+{
+  QList<qint64> ids;
+  ids.reserve(irefs.size());
+  for(QObject *obj : irefs) {
+    if(auto iref = qobject_cast<ImageRef *>(obj)) {
+      ids.append(iref->m_fileId);
+    }
+  }
+  return ids;
+}
+
+void ImageDao::markChanged(ImageRef *iref, int flags)
+{
+  if(m_pendingChanges.isEmpty()) {
+    QMetaObject::invokeMethod(this, &ImageDao::emitChanges, Qt::QueuedConnection);
+  }
+  auto &change = m_pendingChanges[iref];
+  change.iref = iref;
+  change.flags |= flags;
+}
+
+void ImageDao::emitChanges()
+{
+  auto changes = std::exchange(m_pendingChanges, {});
+  QList<QObject *> changed;
+  changed.reserve(changes.size());
+
+  for(const PendingChange &change : changes) {
+    if(!change.iref)
+      continue;
+
+    if(change.flags & TagsChanged) {
+      emit change.iref->tagsChanged();
+    }
+    if(change.flags & DeletedChanged) {
+      emit change.iref->deletedChanged();
+    }
+    changed.append(change.iref);
+  }
+
+  if(!changed.isEmpty()) {
+    emit imagesChanged(changed);
+  }
+}
+
+QList<QObject *> ImageDao::updateTags(const QList<QObject *> &irefs, const QStringList &tags, bool add)
 {
   QList<QObject *> result;
 
   for(QObject *obj : irefs) {
     if(auto iref = qobject_cast<ImageRef *>(obj)) {
-      if(!iref->m_tags.contains(tag)) {
-        iref->m_tags.insert(tag);
-        emit iref->tagsChanged();
+      bool changed = false;
+      for(const QString &tag : tags) {
+        if(iref->m_tags.contains(tag) == add)
+          continue;
+
+        if(add) {
+          iref->m_tags.insert(tag);
+        } else {
+          iref->m_tags.remove(tag);
+        }
+        changed = true;
+      }
 
+      if(changed) {
+        markChanged(iref, TagsChanged);
         result.append(iref);
       }
     }
   }
 
-  emit deferredAddTag(result, tag);
+  if(!result.isEmpty()) {
+    m_writer->submit(WritePriority::UserEdit, TagCommand { fileIds(result), tags, add });
+  }
 
   return result;
 }
 
+QList<QObject *> ImageDao::addTags(const QList<QObject *> &irefs, const QStringList &tags)
+{
+  return updateTags(irefs, tags, true);
+}
+
+QList<QObject *> ImageDao::removeTags(const QList<QObject *> &irefs, const QStringList &tags)
+{
+  return updateTags(irefs, tags, false);
+}
+
+QList<QObject *> ImageDao::addTag(const QList<QObject *> &irefs, const QString &tag)
+{
+  return updateTags(irefs, { tag }, true);
+}
+
 QList<QObject *> ImageDao::removeTag(const QList<QObject *> &irefs, const QString &tag)
 {
+  return updateTags(irefs, { tag }, false);
+}
+
+QList<QObject *> ImageDao::findAllDuplicates(const QList<QObject *> &irefs, int maxDuplicates, bool cascaded)
+{
+  return ::findAllDuplicates(irefs, maxDuplicates, cascaded);
+}
+
+QList<QObject *> ImageDao::findSimilar(qint64 id, int k, int maxDistance)
+{
+  QElapsedTimer timer;
+  timer.start();
+
   QList<QObject *> result;
 
-  for(QObject *obj : irefs) {
-    if(auto iref = qobject_cast<ImageRef *>(obj)) {
-      if(iref->m_tags.contains(tag)) {
-        iref->m_tags.remove(tag);
-        emit iref->tagsChanged();
+  auto ps = m_conn.prepare("SELECT phash FROM image WHERE id = ?1 AND phash IS NOT NULL");
+  ps.bind(1, id);
+  if(!ps.step(SRC_LOCATION))
+    return result;
+  uint64_t hash = ps.resultInteger(0);
+
+  // Deleted images stay in the index and are skipped here, the query is
+  // widened when they crowd out the requested number of results.
+  int want = k + 1;
+  for(;;) {
+    // one extra, the image itself is part of the index
+    std::vector<PHashIndex::Match> matches = phashIndexQuery(m_conn.m_db, hash, want, maxDistance);
+
+    result.clear();
+    for(const auto &match : matches) {
+      if(match.id == id || result.size() == k)
+        continue;
+
+      ImageRef *iref = nullptr;
+      {
+        QReadLocker refMapLocker(&m_refMapLock);
+        iref = m_refMap.value(match.id);
+      }
 
+      if(iref == nullptr) {
+        iref = createImageRef(match.id);
+      }
+
+      if(iref != nullptr && !iref->m_deleted) {
         result.append(iref);
       }
     }
+
+    if(result.size() == k || (int)matches.size() < want)
+      break;
+    want *= 2;
   }
 
-  emit deferredRemoveTag(result, tag);
+  qDebug() << SRC_LOCATION << timer.elapsed() << "ms Number of results:" << result.size();
 
   return result;
 }
 
-QList<QObject *> ImageDao::findAllDuplicates(const QList<QObject *> &irefs, int maxDuplicates)
-{
-  return ::findAllDuplicates(irefs, maxDuplicates);
-}
-
 QVariantList ImageDao::tagCount(const QList<QObject *> &irefs) {
   QMap<QString, int> result;
   for(QObject *qobj : irefs) {
@@ -302,14 +517,19 @@ QList<QObject *> ImageDao::search(const QList<QObject *> &irefs, const QStringLi
 }
 
 QList<QObject *> ImageDao::all(bool includeDeleted)
+{
+  return queryAll(m_conn, includeDeleted);
+}
+
+QList<QObject *> ImageDao::queryAll(const SQLiteConnection &conn, bool includeDeleted)
 {
   QElapsedTimer timer;
   timer.start();
 
   QList<QObject *> result;
 
-  auto ps = m_conn.prepare(
-    "SELECT image.id, group_concat(tag, ' '), width, height, phash, deleted, format, filesize, pixelformat, origin_url "
+  auto ps = conn.prepare(
+    "SELECT image.id, group_concat(tag, ' '), width, height, phash, deleted, format, filesize, pixelformat, origin_url, dhash, bhash, dhash IS NOT NULL "
     "FROM image LEFT JOIN tag ON (tag.id = image.id) "
     "WHERE image.deleted IS NULL OR image.deleted <= ?1"
     "GROUP BY image.id "
@@ -331,6 +551,9 @@ QList<QObject *> ImageDao::all(bool includeDeleted)
     ir->m_fileSize = ps.resultInteger(7);
     ir->m_pixelFormat = (QImage::Format)ps.resultInteger(8);
     ir->m_url = ps.resultString(9);
+    ir->m_dhash = ps.resultInteger(10);
+    ir->m_bhash = ps.resultInteger(11);
+    ir->m_secondaryHashes = ps.resultInteger(12);
 
     m_refMap.insert(ir->m_fileId, ir);
     result.append(ir);
@@ -343,7 +566,12 @@ QList<QObject *> ImageDao::all(bool includeDeleted)
 
 QStringList ImageDao::tagsById(qint64 id)
 {
-  auto ps = m_conn.prepare("SELECT tag FROM tag WHERE id = ?1");
+  return queryTags(m_conn, id);
+}
+
+QStringList ImageDao::queryTags(const SQLiteConnection &conn, qint64 id)
+{
+  auto ps = conn.prepare("SELECT tag FROM tag WHERE id = ?1");
 
   QStringList tags;
 
@@ -358,13 +586,18 @@ QStringList ImageDao::tagsById(qint64 id)
 
 ImageRef *ImageDao::createImageRef(qint64 id)
 {
-  auto ps = m_conn.prepare("SELECT width, height, phash, deleted, format, filesize, pixelformat, origin_url FROM image WHERE id = ?1");
+  return queryImageRef(m_conn, id);
+}
+
+ImageRef *ImageDao::queryImageRef(const SQLiteConnection &conn, qint64 id)
+{
+  auto ps = conn.prepare("SELECT width, height, phash, deleted, format, filesize, pixelformat, origin_url, dhash, bhash, dhash IS NOT NULL FROM image WHERE id = ?1");
   ps.bind(1, id);
   if(!ps.step(SRC_LOCATION))
     return nullptr;
 
   ImageRef *iref = new ImageRef();
-  auto tagsList = tagsById(id);
+  auto tagsList = queryTags(conn, id);
   iref->m_tags = QSet<QString>(tagsList.cbegin(), tagsList.cend());
   iref->m_fileId = id;
   iref->m_selected = false;
@@ -375,61 +608,171 @@ ImageRef *ImageDao::createImageRef(qint64 id)
   iref->m_fileSize = ps.resultInteger(5);
   iref->m_pixelFormat = (QImage::Format)ps.resultInteger(6);
   iref->m_url = ps.resultString(7);
+  iref->m_dhash = ps.resultInteger(8);
+  iref->m_bhash = ps.resultInteger(9);
+  iref->m_secondaryHashes = ps.resultInteger(10);
 
   QWriteLocker refMapLocker(&m_refMapLock);
   m_refMap.insert(iref->m_fileId, iref);
   return iref;
 }
 
-void ImageDao::compressImages(const QList<QObject *> &irefs)
+// Runs query(conn) on the reader pool. Image refs created there are handed
+// over to the GUI thread before the result is published.
+template <typename F>
+auto ImageDao::runRead(F &&query)
 {
-  emit deferredCompressImages(irefs);
+  using T = std::invoke_result_t<F, const SQLiteConnection &>;
+  auto promise = std::make_shared<QPromise<T>>();
+  QFuture<T> future = promise->future();
+
+  m_readerPool.start([this, promise, query = std::forward<F>(query)]() {
+    promise->start();
+    {
+      SQLiteConnection conn = m_connPool.open();
+      promise->addResult(query(conn));
+    }
+    promise->finish();
+  });
+
+  return future;
 }
 
-void ImageDaoDeferredWriter::compressImages(const QList<QObject *> &irefs)
+template <typename T>
+void ImageDao::callWhenReady(const QFuture<T> &future, const QJSValue &callback)
 {
-  startWrite();
+  future.then(this, [this, callback](const T &result) {
+    if(QJSEngine *engine = qjsEngine(this)) {
+      QJSValue(callback).call({ engine->toScriptValue(result) });
+    }
+  });
+}
 
-  for(QObject *ptr : irefs) {
-    if(auto iref = qobject_cast<ImageRef *>(ptr)) {
-      RawImageQuery riq(m_conn, iref->m_fileId);
-      QBuffer buffer(&riq.data);
-      QImageReader reader(&buffer);
-      QByteArray format = reader.format();
-      if(format != "jpeg") {
-        qDebug() << "Re-compressing" << iref->m_fileId;
-        QImage image = reader.read();
-        auto pixFormat = image.format();
-        QBuffer outputBuffer;
-        image.save(&outputBuffer, "jpeg", 95);
-        QByteArray data = outputBuffer.data();
-        qDebug() << "New size" << data.length();
+QFuture<QList<QObject *>> ImageDao::allAsync(bool includeDeleted)
+{
+  return runRead([this, includeDeleted](const SQLiteConnection &conn) {
+    QList<QObject *> result = queryAll(conn, includeDeleted);
+    for(QObject *iref : result) {
+      iref->moveToThread(thread());
+    }
+    return result;
+  });
+}
 
-        {
-          auto ps = m_conn.prepare("UPDATE store SET image = ?1, hash = ?2 WHERE id = ?3");
+QFuture<ImageRef *> ImageDao::createImageRefAsync(qint64 id)
+{
+  return runRead([this, id](const SQLiteConnection &conn) {
+    ImageRef *iref = queryImageRef(conn, id);
+    if(iref != nullptr) {
+      iref->moveToThread(thread());
+    }
+    return iref;
+  });
+}
 
-          //SQLitePreparedStatement ps(idc.conn, );
-          ps.bind(1, data);
-          ps.bind(2, ImageDao::imageHash(data));
-          ps.bind(3, iref->m_fileId);
-          ps.exec(SRC_LOCATION);
-        }
+QFuture<QStringList> ImageDao::tagsByIdAsync(qint64 id)
+{
+  return runRead([id](const SQLiteConnection &conn) {
+    return queryTags(conn, id);
+  });
+}
 
-        {
-          auto ps = m_conn.prepare("UPDATE image SET filesize = ?1, format = ?2 WHERE id = ?3");
-          ps.bind(1, data.size());
-          ps.bind(2, QStringLiteral("jpeg"));
-          ps.bind(3, iref->m_fileId);
-          ps.exec(SRC_LOCATION);
-        }
+QFuture<QVariant> ImageDao::metaGetAsync(const QString &key)
+{
+  return runRead([key](const SQLiteConnection &conn) {
+    return metaGet(conn, key);
+  });
+}
+
+QFuture<QList<QObject *>> ImageDao::findAllDuplicatesAsync(const QList<QObject *> &irefs, int maxDuplicates, bool cascaded)
+{
+  // the refs belong to this thread, the search only gets a copy of the hashes
+  return runRead([candidates = duplicateCandidates(irefs), maxDuplicates, cascaded](const SQLiteConnection &) {
+    return ::findAllDuplicates(candidates, maxDuplicates, cascaded);
+  });
+}
 
-        emit updateImageData(iref, QStringLiteral("jpeg"), data.size(), pixFormat);
+void ImageDao::allAsync(bool includeDeleted, const QJSValue &callback)
+{
+  callWhenReady(allAsync(includeDeleted), callback);
+}
+
+void ImageDao::createImageRefAsync(qint64 id, const QJSValue &callback)
+{
+  callWhenReady(createImageRefAsync(id), callback);
+}
+
+void ImageDao::tagsByIdAsync(qint64 id, const QJSValue &callback)
+{
+  callWhenReady(tagsByIdAsync(id), callback);
+}
+
+void ImageDao::metaGetAsync(const QString &key, const QJSValue &callback)
+{
+  callWhenReady(metaGetAsync(key), callback);
+}
+
+void ImageDao::findAllDuplicatesAsync(const QList<QObject *> &irefs, int maxDuplicates, bool cascaded, const QJSValue &callback)
+{
+  callWhenReady(findAllDuplicatesAsync(irefs, maxDuplicates, cascaded), callback);
+}
+
+void ImageDao::compressImages(const QList<QObject *> &irefs)
+{
+  m_writer->submit(WritePriority::UserEdit, CompressCommand { fileIds(irefs) });
+}
+
+void ImageDaoDeferredWriter::compressImages(const CompressCommand &command)
+{
+  for(qint64 id : command.ids) {
+    startWrite();
+
+    RawImageQuery riq(m_conn, id);
+    QBuffer buffer(&riq.data);
+    QImageReader reader(&buffer);
+    QByteArray format = reader.format();
+    if(format != "jpeg") {
+      qDebug() << "Re-compressing" << id;
+      QImage image = reader.read();
+      auto pixFormat = image.format();
+      QBuffer outputBuffer;
+      image.save(&outputBuffer, "jpeg", 95);
+      QByteArray data = outputBuffer.data();
+      qDebug() << "New size" << data.length();
+
+      {
+        auto ps = m_conn.prepare("UPDATE store SET image = ?1, hash = ?2, sha256 = NULLIF(?3, x'') WHERE id = ?4");
+
+        //SQLitePreparedStatement ps(idc.conn, );
+        QByteArray key = ImageDao::imageHash(data);
+        ps.bind(1, data);
+        ps.bind(2, key);
+        ps.bind(3, ImageDao::verificationHash(data, key));
+        ps.bind(4, id);
+        ps.exec(SRC_LOCATION);
       }
+
+      {
+        auto ps = m_conn.prepare("UPDATE image SET filesize = ?1, format = ?2 WHERE id = ?3");
+        ps.bind(1, data.size());
+        ps.bind(2, QStringLiteral("jpeg"));
+        ps.bind(3, id);
+        ps.exec(SRC_LOCATION);
+      }
+
+      emit updateImageData(id, QStringLiteral("jpeg"), data.size(), pixFormat);
     }
+
+    checkCommit();
   }
 }
 
 QList<QObject *> ImageDao::updateDeleted(const QList<QObject *> &irefs, bool deletedValue)
+{
+  return setDeleted(irefs, deletedValue);
+}
+
+QList<QObject *> ImageDao::setDeleted(const QList<QObject *> &irefs, bool deletedValue)
 {
   QList<QObject *> result;
 
@@ -439,27 +782,82 @@ QList<QObject *> ImageDao::updateDeleted(const QList<QObject *> &irefs, bool del
         continue;
 
       iref->m_deleted = deletedValue;
-      emit iref->deletedChanged();
+      markChanged(iref, DeletedChanged);
       result.append(iref);
     }
   }
 
-  emit deferredUpdateDeleted(result, deletedValue);
+  if(!result.isEmpty()) {
+    m_writer->submit(WritePriority::UserEdit, DeletedCommand { fileIds(result), deletedValue });
+  }
   return result;
 }
 
-static QString formatToExtension(QString format) {
-  if(format == QStringLiteral("jpeg")) {
-    return QStringLiteral("jpg");
+void ImageDao::renderImages(const QList<QObject *> &irefs, const QString &path, int requestedSize, int flags)
+{
+  // The exporter gets plain values, ImageRefs belong to this thread.
+  ImageRenderContext irc { {}, path, QSize(requestedSize, requestedSize), flags };
+  QStringList clipBoardData;
+  for(QObject *obj : irefs) {
+    if(auto ref = qobject_cast<ImageRef *>(obj)) {
+      QString basename = QStringLiteral("%1_%2").arg(ref->tags().join('_')).arg(ref->m_fileId);
+      irc.items.append({ ref->m_fileId, basename, ref->m_format, ref->m_size, ref->m_pixelFormat });
+      clipBoardData.append(basename);
+    }
+  }
+
+  if(m_exporter || !m_pendingExports.isEmpty()) {
+    qInfo("Export to %s queued behind the running one", qPrintable(path));
+    m_pendingExports.append({ irc, clipBoardData });
+    return;
   }
 
-  return format;
+  startExport(irc, clipBoardData);
 }
 
-void ImageDao::renderImages(const QList<QObject *> &irefs, const QString &path, int requestedSize, int flags)
+void ImageDao::startExport(const ImageRenderContext &irc, const QStringList &clipBoardData)
 {
-  ImageRenderContext irc { irefs, path, QSize(requestedSize, requestedSize), flags };
-  emit deferredRenderImages(irc);
+  int flags = irc.flags;
+  auto thread = new QThread(this);
+  auto exporter = new ImageExporter(irc);
+  exporter->moveToThread(thread);
+  m_exporter = exporter;
+
+  static const QString taskName = QStringLiteral("renderImages");
+
+  connect(thread, &QThread::started, exporter, &ImageExporter::run);
+  connect(exporter, &ImageExporter::manifestChanged, this, [this](const ExportManifestCommand &command) {
+    m_writer->submit(WritePriority::UserEdit, command);
+  }, Qt::DirectConnection);
+  connect(exporter, &ImageExporter::progress, this, [this](qint64 done, qint64 total, qreal imagesPerSecond) {
+    qint64 eta = imagesPerSecond > 0 ? (total - done) * 1000 / imagesPerSecond : -1;
+    setTaskStatus(taskName, QStringLiteral("Rendering images (%1 images/s)").arg(imagesPerSecond, 0, 'f', 1), done, total, eta);
+    m_progress = total > 0 ? (qreal)done / total : -1;
+    emit busyChanged();
+    emit taskProgress(done, total);
+  });
+  connect(exporter, &ImageExporter::finished, this, [this, flags, clipBoardData](qint64 written, qint64 failed) {
+    m_exporter = nullptr;
+    m_progress = -1;
+    emit busyChanged();
+    setTaskStatus(QString(), QString(), 0, 0, -1);
+
+    if(flags & FNAME_TO_CLIPBOARD) {
+      setClipboard(clipBoardData.join('\n'));
+    }
+    emit exportFinished(written, failed);
+    emit taskFinished(taskName);
+
+    if(!m_pendingExports.isEmpty() && !m_exporter) {
+      PendingExport next = m_pendingExports.takeFirst();
+      startExport(next.irc, next.clipBoardData);
+    }
+  });
+  connect(exporter, &ImageExporter::finished, thread, &QThread::quit, Qt::DirectConnection);
+  connect(thread, &QThread::finished, exporter, &QObject::deleteLater);
+  connect(thread, &QThread::finished, thread, &QObject::deleteLater);
+
+  thread->start();
 }
 
 void ImageDao::backgroundTask(const QString &name)
@@ -467,6 +865,78 @@ void ImageDao::backgroundTask(const QString &name)
   emit deferredBackgroundTask(name);
 }
 
+void ImageDao::ingestImage(const QUrl &url, const QByteArray &data, std::shared_ptr<const void> keepAlive, const QByteArray &hash)
+{
+  m_ingest.submit(url, data, keepAlive, hash);
+  QMetaObject::invokeMethod(this, &ImageDao::ingestChanged, Qt::QueuedConnection);
+}
+
+bool ImageDao::importPaths(const QStringList &paths)
+{
+  if(m_importer) {
+    qInfo("Import of %lld paths queued behind the running one", (long long)paths.size());
+    m_pendingImports.append(paths);
+    return true;
+  }
+
+  startImport(paths);
+  return true;
+}
+
+void ImageDao::startImport(const QStringList &paths)
+{
+  auto thread = new QThread(this);
+  auto importer = new ImageImporter(paths);
+  importer->moveToThread(thread);
+  m_importer = importer;
+
+  connect(thread, &QThread::started, importer, &ImageImporter::run);
+  connect(importer, &ImageImporter::progress, this, &ImageDao::setImportProgress);
+  connect(importer, &ImageImporter::progress, this, &ImageDao::importProgress);
+  connect(importer, &ImageImporter::finished, this, [this](qint64 imported, qint64 skipped, qint64 failed) {
+    m_importer = nullptr;
+    m_progress = -1;
+    emit busyChanged();
+    emit importFinished(imported, skipped, failed);
+
+    if(!m_pendingImports.isEmpty() && !m_importer) {
+      startImport(std::exchange(m_pendingImports, {}));
+    }
+  });
+  connect(importer, &ImageImporter::finished, thread, &QThread::quit, Qt::DirectConnection);
+  connect(thread, &QThread::finished, importer, &QObject::deleteLater);
+  connect(thread, &QThread::finished, thread, &QObject::deleteLater);
+
+  thread->start();
+}
+
+void ImageDao::sync()
+{
+  QMetaObject::invokeMethod(m_writer, &ImageDaoDeferredWriter::sync, Qt::BlockingQueuedConnection);
+}
+
+void ImageDao::cancelBackgroundTask()
+{
+  m_writer->cancel();
+  if(m_importer) {
+    m_importer->cancel();
+  }
+  if(m_exporter) {
+    m_exporter->cancel();
+  }
+
+  if(!m_pendingImports.isEmpty()) {
+    qInfo("Dropped %lld queued import paths", (long long)m_pendingImports.size());
+    m_pendingImports.clear();
+  }
+
+  // queued exports are dropped, each still reports that it finished
+  qsizetype dropped = std::exchange(m_pendingExports, {}).size();
+  for(qsizetype i = 0; i < dropped; i++) {
+    emit taskFinished(QStringLiteral("renderImages"));
+  }
+}
+
 static bool greaterThan(const QSize &a, const QSize &b) {
   return a.width() > b.width() && a.height() > b.height();
 }
@@ -561,18 +1031,7 @@ QImage ImageDao::makeThumbnail(SQLiteConnection *conn, ImageRef *iref, int thumb
     return result;
   }
 
-  {
-    QMutexLocker lock(conn->writeLock());
-    conn->exec("BEGIN", SRC_LOCATION);
-    char sql[256];
-    snprintf(sql, sizeof sql, "INSERT INTO thumb%d (id, image) VALUES (?1, ?2)", thumbsize);
-    auto ps_w = conn->prepare(sql);
-
-    ps_w.bind(1, iref->m_fileId);
-    ps_w.bind(2, outputBuffer.buffer());
-    ps_w.exec(SRC_LOCATION);
-    conn->exec("COMMIT", SRC_LOCATION);
-  }
+  m_writer->submit(WritePriority::Cache, ThumbnailCommand { iref->m_fileId, thumbsize, outputBuffer.buffer() });
 
   return result;
 }
@@ -585,19 +1044,20 @@ QImage ImageDao::requestImage(qint64 id, const QSize &requestedSize, volatile bo
     return result;
   }
 
+  m_writer->noteActivity();
+
   if(requestedSize.isValid()) {
     QSize actualSize;
     ImageRef *iref = nullptr;
     {
       QReadLocker refMapLocker(&m_refMapLock);
-      iref = m_refMap.constFind(id).value();
+      iref = m_refMap.value(id);
       Q_ASSERT(iref != nullptr);
       actualSize = iref->m_size;
     }
 
-    int thumbSizeList[] = { 40, 80, 160, 320, 640, 1280 };
     QSize thumbSize;
-    for(int tsize : thumbSizeList) {
+    for(int tsize : thumbnailSizes) {
       QSize testSize(tsize, tsize);
       if(greaterThanOrEqual(testSize, requestedSize)) {
         thumbSize = testSize;
@@ -651,10 +1111,42 @@ QImage ImageDao::requestImage(qint64 id, const QSize &requestedSize, volatile bo
   return result;
 }
 
-QString ImageDao::imageHash(const QByteArray &data)
+QByteArray ImageDao::imageHash(const QByteArray &data)
+{
+  return imageHash(data, contentHash());
+}
+
+QByteArray ImageDao::imageHash(const QByteArray &data, ContentHash algorithm)
 {
-  QByteArray hashBytes = QCryptographicHash::hash(data, QCryptographicHash::Sha256);
-  return hashBytes.toHex();
+  if(algorithm == Xxh3_128) {
+    XXH128_canonical_t canonical;
+    XXH128_canonicalFromHash(&canonical, XXH3_128bits(data.constData(), data.size()));
+    return QByteArray((const char *)canonical.digest, sizeof(canonical.digest));
+  }
+  return QCryptographicHash::hash(data, QCryptographicHash::Sha256);
+}
+
+QByteArray ImageDao::verificationHash(const QByteArray &data, const QByteArray &key)
+{
+  if(keyAlgorithm(key) == Sha256)
+    return QByteArray();
+  return QCryptographicHash::hash(data, QCryptographicHash::Sha256);
+}
+
+void ImageDao::convertKey(const QByteArray &data, QByteArray *key, QByteArray *sha256)
+{
+  ContentHash algorithm = contentHash();
+  if(keyAlgorithm(*key) == algorithm)
+    return;
+
+  if(algorithm == Sha256) {
+    *key = sha256->isEmpty() ? imageHash(data, Sha256) : *sha256;
+    *sha256 = QByteArray();
+  } else {
+    // the old key is the SHA-256
+    *sha256 = *key;
+    *key = imageHash(data, Xxh3_128);
+  }
 }
 
 ImageDao *ImageDao::instance()
@@ -670,55 +1162,277 @@ void ImageDao::setBusy(bool busyState)
 {
   if(m_busy != busyState) {
     m_busy = busyState;
+    if(!m_busy) {
+      m_progress = -1;
+    }
     emit busyChanged();
   }
 }
 
-void ImageDao::updateImageData(ImageRef *update, const QString &newFormat, qint64 newFileSize, QImage::Format newPixelFormat)
+void ImageDao::setProgress(qint64 done, qint64 total)
 {
-  update->updateImageData(newFormat, newFileSize, newPixelFormat);
+  m_progress = total > 0 ? (qreal)done / total : -1;
+  emit busyChanged();
 }
 
-void ImageDao::setClipboard(const QString &data)
+void ImageDao::setImportProgress(qint64 done, qint64 total)
 {
-  QClipboard *cb = QGuiApplication::clipboard();
-  cb->setText(data);
+  m_progress = total > 0 ? (qreal)done / total : -1;
+  emit busyChanged();
 }
 
-void ImageDaoDeferredWriter::startWrite() {
-  if(!m_inTransaction) {
-    startBusy();
-
-    m_conn.writeLock()->lock();
-    m_conn.exec("BEGIN", SRC_LOCATION);
-    m_inTransaction = true;
-    QTimer::singleShot(0, this, &ImageDaoDeferredWriter::endWrite);
+void ImageDao::setCommitLatency(int ms)
+{
+  if(ms != m_writer->commitLatency()) {
+    m_writer->setCommitLatency(ms);
+    emit commitPolicyChanged();
   }
 }
 
+void ImageDao::setCommitRowLimit(int rows)
+{
+  if(rows != m_writer->commitRowLimit()) {
+    m_writer->setCommitRowLimit(rows);
+    emit commitPolicyChanged();
+  }
+}
 
-ImageDaoDeferredWriter::ImageDaoDeferredWriter(SQLiteConnection &&conn, QObject *parent) : m_conn(std::move(conn)), QObject(parent)
+void ImageDao::setCommitMaxOpen(int ms)
 {
+  if(ms != m_writer->commitMaxOpen()) {
+    m_writer->setCommitMaxOpen(ms);
+    emit commitPolicyChanged();
+  }
+}
 
+void ImageDao::setCommitStats(qreal commitsPerSecond, qreal rowsPerCommit)
+{
+  m_commitsPerSecond = commitsPerSecond;
+  m_rowsPerCommit = rowsPerCommit;
+  emit commitStatsChanged();
 }
 
-ImageDaoDeferredWriter::~ImageDaoDeferredWriter()
+void ImageDao::setTaskStatus(const QString &name, const QString &phase, qint64 done, qint64 total, qint64 etaMs)
 {
+  m_taskName = name;
+  m_taskPhase = phase;
+  m_taskDone = done;
+  m_taskTotal = total;
+  m_taskEta = etaMs;
+  emit taskStatusChanged();
 }
 
-void ImageDaoDeferredWriter::endWrite() {
-  if(m_inTransaction) {
-    m_conn.exec("COMMIT", SRC_LOCATION);
-    m_inTransaction = false;
-    m_conn.writeLock()->unlock();
+void ImageDao::setCheckpointStats(qint64 walSize, qint64 durationMs)
+{
+  if(walSize == m_walSize && durationMs < 0)
+    return;
+
+  m_walSize = walSize;
+  if(durationMs >= 0) {
+    m_lastCheckpointDuration = durationMs;
   }
+  emit checkpointStatsChanged();
 }
 
-void ImageDaoDeferredWriter::startBusy()
+void ImageDao::setIngestRate(qreal imagesPerSecond)
 {
-  if(!m_busy) {
-    m_busy = true;
-    emit busyChanged(m_busy);
+  m_ingestRate = imagesPerSecond;
+  emit ingestChanged();
+}
+
+void ImageDao::updateImageData(qint64 id, const QString &newFormat, qint64 newFileSize, QImage::Format newPixelFormat)
+{
+  ImageRef *iref;
+  {
+    QReadLocker refMapLocker(&m_refMapLock);
+    iref = m_refMap.value(id);
+  }
+  if(iref != nullptr) {
+    iref->updateImageData(newFormat, newFileSize, newPixelFormat);
+  }
+}
+
+void ImageDao::setClipboard(const QString &data)
+{
+  QClipboard *cb = QGuiApplication::clipboard();
+  cb->setText(data);
+}
+
+// Called once the writer has given back its connection and holds its
+// commands. This thread's connection is returned last, other borrowers get a
+// few seconds to finish their queries and new ones wait meanwhile.
+void ImageDao::replaceDatabase(const QString &path)
+{
+  m_conn = SQLiteConnection();
+  bool replaced = m_connPool.replaceDatabase(path, 5000);
+  m_conn = m_connPool.open();
+  emit databaseReplaced(replaced);
+}
+
+void ImageDaoDeferredWriter::startWrite() {
+  if(!m_inTransaction) {
+    startBusy();
+
+    m_conn.writeLock()->lock();
+    m_conn.exec("BEGIN", SRC_LOCATION);
+    m_inTransaction = true;
+    m_transactionChanges = sqlite3_total_changes(m_conn.m_db);
+    m_transactionTimer.start();
+    m_commitTimer.start(m_commitLatency.loadRelaxed());
+  }
+}
+
+// Used after a failed statement. SQLite rolls back on its own after some
+// errors, an interrupt among them, so the transaction may already be gone.
+void ImageDaoDeferredWriter::rollbackWrite()
+{
+  if(m_inTransaction) {
+    m_commitTimer.stop();
+    if(!sqlite3_get_autocommit(m_conn.m_db)) {
+      m_conn.exec("ROLLBACK", SRC_LOCATION);
+    }
+    m_inTransaction = false;
+    m_conn.writeLock()->unlock();
+  }
+}
+
+// Commits early once the row limit or the hard cap is reached, the commit
+// timer can't fire while a long command keeps the event loop busy.
+void ImageDaoDeferredWriter::checkCommit()
+{
+  if(!m_inTransaction)
+    return;
+
+  int rows = sqlite3_total_changes(m_conn.m_db) - m_transactionChanges;
+  if(rows >= m_commitRowLimit.loadRelaxed() || m_transactionTimer.elapsed() >= m_commitMaxOpen.loadRelaxed()) {
+    endWrite();
+  }
+}
+
+void ImageDaoDeferredWriter::updateCommitStats(int rows)
+{
+  m_commitStatsCommits++;
+  m_commitStatsRows += rows;
+}
+
+void ImageDaoDeferredWriter::startCommitStats()
+{
+  m_commitStatsTimer.start();
+  m_commitStatsTick.start(1000);
+}
+
+// Runs from a timer rather than on commit, so the rate drops to zero once
+// writes stop.
+void ImageDaoDeferredWriter::publishCommitStats()
+{
+  qint64 elapsed = m_commitStatsTimer.restart();
+  bool idle = m_commitStatsCommits == 0;
+  if(idle && m_commitStatsIdle)
+    return;
+
+  m_commitStatsIdle = idle;
+  emit commitStatsChanged(m_commitStatsCommits * 1000.0 / qMax<qint64>(1, elapsed), idle ? 0 : (qreal)m_commitStatsRows / m_commitStatsCommits);
+  m_commitStatsCommits = 0;
+  m_commitStatsRows = 0;
+}
+
+
+ImageDaoDeferredWriter::ImageDaoDeferredWriter(SQLiteConnection &&conn, QObject *parent) : m_conn(std::move(conn)), QObject(parent), m_commitTimer(this), m_commitStatsTick(this), m_checkpointTimer(this)
+{
+  m_commitTimer.setSingleShot(true);
+  connect(&m_commitTimer, &QTimer::timeout, this, &ImageDaoDeferredWriter::endWrite);
+  connect(&m_commitStatsTick, &QTimer::timeout, this, &ImageDaoDeferredWriter::publishCommitStats);
+  connect(&m_checkpointTimer, &QTimer::timeout, this, &ImageDaoDeferredWriter::checkpoint);
+  m_activityClock.start();
+  m_connPool = m_conn.m_pool;
+}
+
+// Checkpoints are taken over from SQLite's auto-checkpoint, which runs inside
+// whichever commit crosses the threshold and gives up when readers are active.
+void ImageDaoDeferredWriter::startCheckpoints()
+{
+  m_walPath = QString::fromUtf8(sqlite3_db_filename(m_conn.m_db, "main")) + QStringLiteral("-wal");
+  sqlite3_wal_autocheckpoint(m_conn.m_db, 0);
+  m_checkpointTimer.start(checkpointInterval);
+}
+
+// A passive checkpoint copies what it can without waiting for readers, it
+// runs while the application is busy and the WAL has grown past a threshold.
+// Once reads and writes have been quiet for a while a truncating checkpoint
+// resets the WAL file to zero bytes.
+void ImageDaoDeferredWriter::checkpoint()
+{
+  if(m_inTransaction || m_replacingDatabase)
+    return;
+
+  qint64 walSize = QFileInfo(m_walPath).size();
+  bool idle = !m_busy && m_activityClock.elapsed() - m_lastActivity.load(std::memory_order_relaxed) >= checkpointIdleTime;
+
+  int mode;
+  if(idle && walSize > 0) {
+    mode = SQLITE_CHECKPOINT_TRUNCATE;
+  } else if(m_commitsSinceCheckpoint > 0 && walSize >= checkpointPassiveSize) {
+    mode = SQLITE_CHECKPOINT_PASSIVE;
+  } else {
+    emit checkpointStatsChanged(walSize, -1);
+    return;
+  }
+
+  QElapsedTimer timer;
+  timer.start();
+  int logFrames = 0;
+  int checkpointedFrames = 0;
+  int rc = sqlite3_wal_checkpoint_v2(m_conn.m_db, nullptr, mode, &logFrames, &checkpointedFrames);
+  qint64 duration = timer.elapsed();
+
+  if(rc == SQLITE_OK) {
+    m_commitsSinceCheckpoint = 0;
+    qDebug("%s checkpoint of %d/%d frames took %lld ms", mode == SQLITE_CHECKPOINT_TRUNCATE ? "Truncating" : "Passive", checkpointedFrames, logFrames, duration);
+  } else if(rc != SQLITE_BUSY) {
+    qWarning("WAL checkpoint failed: %s", sqlite3_errmsg(m_conn.m_db));
+  }
+
+  emit checkpointStatsChanged(QFileInfo(m_walPath).size(), duration);
+}
+
+ImageDaoDeferredWriter::~ImageDaoDeferredWriter()
+{
+  // a compaction may still be copying on the task reader
+  cancel();
+  m_workerPool.waitForDone();
+  discardCompaction();
+
+  // images held back by an unfinished key rewrite
+  if(m_rekeying) {
+    m_rekeying = false;
+    flushIngest();
+    endWrite();
+  }
+}
+
+// Returns false when the commit failed and the transaction was rolled back.
+bool ImageDaoDeferredWriter::endWrite() {
+  if(!m_inTransaction)
+    return true;
+
+  m_commitTimer.stop();
+  if(!m_conn.exec("COMMIT", SRC_LOCATION)) {
+    rollbackWrite();
+    return false;
+  }
+
+  m_inTransaction = false;
+  m_conn.writeLock()->unlock();
+  m_commitsSinceCheckpoint++;
+  updateCommitStats(sqlite3_total_changes(m_conn.m_db) - m_transactionChanges);
+  return true;
+}
+
+void ImageDaoDeferredWriter::startBusy()
+{
+  if(!m_busy) {
+    m_busy = true;
+    emit busyChanged(m_busy);
     QTimer::singleShot(0, this, &ImageDaoDeferredWriter::endBusy);
   }
 }
@@ -726,7 +1440,7 @@ void ImageDaoDeferredWriter::startBusy()
 
 void ImageDaoDeferredWriter::endBusy()
 {
-  if(m_busy) {
+  if(m_busy && !m_taskRunning) {
     m_busy = false;
     emit busyChanged(m_busy);
   }
@@ -737,179 +1451,842 @@ void ImageDaoDeferredWriter::backgroundTask(const QString &name)
   QString task("task_");
   task.append(name);
 
+  if(m_taskRunning) {
+    qWarning() << "Background task" << name << "ignored, another task is still running";
+    return;
+  }
+
   startBusy();
-  QMetaObject::invokeMethod(this, qUtf8Printable(task), Qt::DirectConnection);
+  // queued edits must not share a transaction the task might roll back
+  endWrite();
+  beginTask(name);
+  m_taskRunning = true;
+  if(!QMetaObject::invokeMethod(this, qUtf8Printable(task), Qt::DirectConnection)) {
+    qWarning() << "Unknown background task" << name;
+    endTask();
+  }
 }
 
-void ImageDaoDeferredWriter::addTag(const QList<QObject *> &irefs, const QString &tag)
+// The progress handler aborts the current statement as soon as a cancel is
+// requested, so large deletes and VACUUM stop promptly.
+int ImageDaoDeferredWriter::interruptHandler(void *writer)
 {
-  startWrite();
-  auto ps = m_conn.prepare("INSERT OR IGNORE INTO tag (id, tag) VALUES (?1, ?2)");
-  for(QObject *qobj : irefs) {
-    if(auto iref = qobject_cast<ImageRef *>(qobj)) {
-      ps.bind(1, iref->m_fileId);
-      ps.bind(2, tag);
-      ps.exec(SRC_LOCATION);
-    }
+  return static_cast<ImageDaoDeferredWriter *>(writer)->taskCancelled() ? 1 : 0;
+}
+
+// Runs a statement that belongs to the current task. Only these can be
+// interrupted, and a failure rolls back the task's transaction, which never
+// contains anything else.
+bool ImageDaoDeferredWriter::taskExec(const SQLitePreparedStatement &ps)
+{
+  sqlite3_progress_handler(m_conn.m_db, 10000, &ImageDaoDeferredWriter::interruptHandler, this);
+  bool ok = ps.exec(SRC_LOCATION);
+  sqlite3_progress_handler(m_conn.m_db, 0, nullptr, nullptr);
+
+  if(!ok) {
+    rollbackWrite();
   }
+  return ok;
 }
 
-void ImageDaoDeferredWriter::removeTag(const QList<QObject *> &irefs, const QString &tag)
+bool ImageDaoDeferredWriter::taskExec(const char *sql)
 {
-  startWrite();
-  auto ps = m_conn.prepare("DELETE FROM tag WHERE id = ?1 AND tag = ?2");
-  for(QObject *qobj : irefs) {
-    if(auto iref = qobject_cast<ImageRef *>(qobj)) {
-      ps.bind(1, iref->m_fileId);
-      ps.bind(2, tag);
-      ps.exec(SRC_LOCATION);
-    }
+  return taskExec(m_conn.prepare(sql));
+}
+
+void ImageDaoDeferredWriter::beginTask(const QString &name)
+{
+  m_cancelRequested.storeRelaxed(0);
+  m_taskName = name;
+  setTaskPhase(QString());
+}
+
+// Starts a new phase, a total of 0 means the amount of work is unknown.
+void ImageDaoDeferredWriter::setTaskPhase(const QString &phase, qint64 total)
+{
+  m_taskPhase = phase;
+  m_taskTotal = total;
+  m_taskPhaseTimer.start();
+  reportProgress(0, true);
+}
+
+void ImageDaoDeferredWriter::reportProgress(qint64 done, bool force)
+{
+  if(!force && m_taskReportTimer.isValid() && m_taskReportTimer.elapsed() < 100)
+    return;
+
+  m_taskReportTimer.start();
+
+  qint64 eta = -1;
+  if(done > 0 && m_taskTotal > 0) {
+    eta = m_taskPhaseTimer.elapsed() * qMax<qint64>(0, m_taskTotal - done) / done;
   }
+
+  emit taskStatusChanged(m_taskName, m_taskPhase, done, m_taskTotal, eta);
+  emit progressChanged(done, m_taskTotal);
 }
 
-void ImageDaoDeferredWriter::updateDeleted(const QList<QObject *> &irefs, bool deleted)
+void ImageDaoDeferredWriter::endTask()
 {
-  startWrite();
-  auto ps = m_conn.prepare("UPDATE image SET deleted = ?1 WHERE id = ?2");
-  for(QObject *ptr : irefs) {
-    if(auto iref = qobject_cast<ImageRef *>(ptr)) {
-      ps.bind(1, (qint64)deleted);
-      ps.bind(2, iref->m_fileId);
-      ps.exec(SRC_LOCATION);
+  m_taskRunning = false;
+  endWrite();
+
+  if(taskCancelled()) {
+    qInfo() << "Task" << m_taskName << "cancelled";
+  }
+
+  QString name = std::exchange(m_taskName, QString());
+  m_taskPhase.clear();
+  m_taskTotal = 0;
+  emit taskStatusChanged(QString(), QString(), 0, 0, -1);
+  emit progressChanged(0, 0);
+  emit taskFinished(name);
+  endBusy();
+}
+
+// Id and tag lists are passed as JSON arrays and expanded with json_each(),
+// so a bulk edit is a single statement regardless of the selection size.
+static QString jsonIdArray(const QList<qint64> &ids)
+{
+  QString json;
+  json.reserve(ids.size() * 8 + 2);
+  json += QLatin1Char('[');
+  for(qsizetype i = 0; i < ids.size(); i++) {
+    if(i > 0) {
+      json += QLatin1Char(',');
     }
+    json += QString::number(ids[i]);
   }
+  json += QLatin1Char(']');
+  return json;
 }
 
-void ImageDaoDeferredWriter::writeImage(const QUrl &url, const QByteArray &data)
+void ImageDaoDeferredWriter::updateTags(const TagCommand &command)
 {
   startWrite();
-  QString hash = ImageDao::imageHash(data);
+  auto ps = m_conn.prepare(command.add ?
+    "INSERT OR IGNORE INTO tag (id, tag) SELECT i.value, t.value FROM json_each(?1) i, json_each(?2) t" :
+    "DELETE FROM tag WHERE id IN (SELECT value FROM json_each(?1)) AND tag IN (SELECT value FROM json_each(?2))");
+  ps.bind(1, jsonIdArray(command.ids));
+  ps.bind(2, QString::fromUtf8(QJsonDocument(QJsonArray::fromStringList(command.tags)).toJson(QJsonDocument::Compact)));
+  ps.exec(SRC_LOCATION);
+}
 
-  {
-    auto ps = m_conn.prepare("INSERT OR IGNORE INTO store (hash, image) VALUES (?1, ?2)");
-    ps.bind(1, hash);
-    ps.bind(2, data);
-    ps.exec(SRC_LOCATION);
+void ImageDaoDeferredWriter::updateDeleted(const DeletedCommand &command)
+{
+  startWrite();
+  auto ps = m_conn.prepare("UPDATE image SET deleted = ?2 WHERE id IN (SELECT value FROM json_each(?1))");
+  ps.bind(1, jsonIdArray(command.ids));
+  ps.bind(2, (qint64)command.deleted);
+  ps.exec(SRC_LOCATION);
+}
+
+void ImageDaoDeferredWriter::updateExportManifest(const ExportManifestCommand &command)
+{
+  startWrite();
+
+  auto ps_delete = m_conn.prepare("DELETE FROM export_manifest WHERE path = ?1 AND id = ?2");
+  for(qint64 id : command.removed) {
+    ps_delete.bind(1, command.path);
+    ps_delete.bind(2, id);
+    ps_delete.exec(SRC_LOCATION);
+  }
+
+  auto ps_insert = m_conn.prepare("INSERT OR REPLACE INTO export_manifest (path, id, hash, size, flags, filename) VALUES (?1, ?2, ?3, ?4, ?5, ?6)");
+  for(const ExportManifestEntry &entry : command.written) {
+    ps_insert.bind(1, command.path);
+    ps_insert.bind(2, entry.id);
+    ps_insert.bind(3, entry.hash);
+    ps_insert.bind(4, command.size);
+    ps_insert.bind(5, command.flags);
+    ps_insert.bind(6, entry.filename);
+    ps_insert.exec(SRC_LOCATION);
+  }
+}
+
+void ImageDaoDeferredWriter::submit(WritePriority priority, WriteCommand command)
+{
+  m_commands[(int)priority].push(std::move(command));
+  noteActivity();
+  if(!m_drainScheduled.exchange(true)) {
+    QMetaObject::invokeMethod(this, &ImageDaoDeferredWriter::drainCommands, Qt::QueuedConnection);
+  }
+}
+
+bool ImageDaoDeferredWriter::popCommand(WriteCommand &command)
+{
+  for(auto &queue : m_commands) {
+    if(queue.pop(command))
+      return true;
   }
+  return false;
+}
 
-  if(sqlite3_changes(m_conn.m_db) == 0) {
-    qWarning("Duplicate image not inserted");
+// Applies a slice of commands, highest priority first. When commands remain
+// another drain is queued behind the events that arrived in the meantime.
+void ImageDaoDeferredWriter::drainCommands()
+{
+  // resumeAfterReplace() drains again
+  if(m_replacingDatabase)
     return;
+
+  WriteCommand command;
+  for(int n = 0; n < drainSlice; n++) {
+    if(!popCommand(command)) {
+      // A producer that saw the flag still set relies on this check.
+      m_drainScheduled.store(false);
+      if(!popCommand(command)) {
+        flushIngest();
+        return;
+      }
+      m_drainScheduled.store(true);
+    }
+    apply(command);
+    checkCommit();
   }
 
-  qint64 last_id = sqlite3_last_insert_rowid(m_conn.m_db);
-  qInfo() << "Inserted image with ID" << last_id << "from" << url.toString();
+  QMetaObject::invokeMethod(this, &ImageDaoDeferredWriter::drainCommands, Qt::QueuedConnection);
+}
 
-  {
-    auto ps = m_conn.prepare("INSERT INTO image (id, date, origin_url) VALUES (?1, datetime(), ?2)");
-    ps.bind(1, last_id);
-    ps.bind(2, url.toString());
-    ps.exec(SRC_LOCATION);
+// Applies all queued commands and commits.
+void ImageDaoDeferredWriter::sync()
+{
+  if(m_replacingDatabase) {
+    qWarning("Sync ignored while the database file is replaced");
+    return;
   }
 
-  updateImageMetaData(&m_conn, data, last_id);
+  WriteCommand command;
+  while(popCommand(command)) {
+    apply(command);
+  }
 
+  flushIngest();
   endWrite();
+}
 
-  emit writeComplete(url, last_id);
+void ImageDaoDeferredWriter::apply(WriteCommand &command)
+{
+  if(auto meta = std::get_if<MetaPutCommand>(&command)) {
+    startWrite();
+    ImageDao::metaPut(m_conn, meta->key, meta->value);
+  } else if(auto thumb = std::get_if<ThumbnailCommand>(&command)) {
+    startWrite();
+    char sql[256];
+    snprintf(sql, sizeof sql, "INSERT OR IGNORE INTO thumb%d (id, image) VALUES (?1, ?2)", thumb->size);
+    auto ps = m_conn.prepare(sql);
+    ps.bind(1, thumb->id);
+    ps.bindStatic(2, thumb->data);
+    ps.exec(SRC_LOCATION);
+  } else if(auto item = std::get_if<IngestItem>(&command)) {
+    insertImage(*item);
+  } else if(auto tags = std::get_if<TagCommand>(&command)) {
+    updateTags(*tags);
+  } else if(auto deleted = std::get_if<DeletedCommand>(&command)) {
+    updateDeleted(*deleted);
+  } else if(auto compress = std::get_if<CompressCommand>(&command)) {
+    compressImages(*compress);
+  } else if(auto manifest = std::get_if<ExportManifestCommand>(&command)) {
+    updateExportManifest(*manifest);
+  }
 }
 
-void ImageDaoDeferredWriter::renderImages(const ImageRenderContext &ric)
+void ImageDaoDeferredWriter::insertImage(const IngestItem &item)
 {
-  startBusy();
+  m_pendingIngest.append(item);
+  if(m_pendingIngest.size() >= m_ingestBatchSize) {
+    flushIngest();
+  }
+}
 
-  const QSize &reqSize = ric.size;
+// Hashes and metadata were prepared by the ingest pipeline, all that is left
+// is a batch of inserts in a single transaction.
+void ImageDaoDeferredWriter::flushIngest()
+{
+  if(m_pendingIngest.isEmpty() || m_rekeying)
+    return;
 
-  QStringList clipBoardData;
-  for(QObject *rptr : ric.irefs) {
-    ImageRef *ref = qobject_cast<ImageRef *>(rptr);
+  if(!m_ingestTimer.isValid() || m_ingestLast.elapsed() > 2000) {
+    m_ingestTimer.start();
+    m_ingestCount = 0;
+  }
 
-    RawImageQuery riq(m_conn, ref->m_fileId);
-    QBuffer buffer(&riq.data);
-    QImageReader reader(&buffer);
-    QByteArray format = reader.format();
+  QList<QPair<QUrl, qint64>> written;
+  std::vector<PHashIndex::Match> hashed;
+
+  startWrite();
+  {
+    auto ps_store = m_conn.prepare("INSERT OR IGNORE INTO store (hash, sha256, image) VALUES (?1, NULLIF(?2, x''), ?3)");
+    auto ps_image = m_conn.prepare("INSERT INTO image (id, date, origin_url) VALUES (?1, datetime(), ?2)");
+    auto ps_verify = m_conn.prepare("SELECT sha256 FROM store WHERE hash = ?1");
+
+    for(const IngestItem &item : m_pendingIngest) {
+      // items hashed before the store keys were rewritten
+      QByteArray key = item.hash;
+      QByteArray sha256 = item.sha256;
+      ImageDao::convertKey(item.data, &key, &sha256);
+
+      ps_store.bind(1, key);
+      ps_store.bind(2, sha256);
+      ps_store.bindStatic(3, item.data);
+      ps_store.exec(SRC_LOCATION);
+
+      if(sqlite3_changes(m_conn.m_db) == 0) {
+        ps_verify.bind(1, key);
+        if(!sha256.isEmpty() && ps_verify.step(SRC_LOCATION) && ps_verify.resultBlobPointer(0) != sha256) {
+          qWarning() << "XXH3-128 collision, image not inserted" << item.url.toString();
+        } else {
+          qWarning() << "Duplicate image not inserted" << item.url.toString();
+        }
+        ps_verify.reset();
+        continue;
+      }
 
-    QString basename = QStringLiteral("%1_%2").arg(ref->tags().join('_')).arg(ref->m_fileId);
-    clipBoardData.append(basename);
+      qint64 last_id = sqlite3_last_insert_rowid(m_conn.m_db);
+      qInfo() << "Inserted image with ID" << last_id << "from" << item.url.toString();
 
-    QString effectiveFormat = reqSize.isValid() ? QStringLiteral("jpeg") : ref->m_format;
-    QString extension = formatToExtension(effectiveFormat);
-    QDir dir(ric.path);
-    dir.mkpath(QStringLiteral("."));
-    QString filename = dir.filePath(basename).append('.').append(extension);
+      ps_image.bind(1, last_id);
+      ps_image.bind(2, item.url.toString());
+      ps_image.exec(SRC_LOCATION);
 
-    if(reqSize.isValid()) {
-      QImage image = reader.read();
-      image = image.scaled(reqSize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
-
-      if(ric.flags & ImageDao::PAD_TO_FIT) {
-        QImage surface(reqSize, QImage::Format_RGB32);
-        surface.fill(Qt::black);
-        QPainter painter(&surface);
-        painter.drawImage((surface.width() - image.width()) / 2, (surface.height() - image.height()) / 2, image);
-        image = surface;
+      if(item.meta.valid) {
+        storeImageMetaData(&m_conn, item.meta, last_id);
+        hashed.push_back({ last_id, item.meta.phash, 0 });
       }
 
-      image.save(filename, "jpeg", 95);
-    } else {
-      QFile file(filename);
-      if(file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
-        file.write(riq.data);
-      }
+      written.append({ item.url, last_id });
+    }
+  }
+  if(endWrite()) {
+    for(const auto &h : hashed) {
+      phashIndexInsert(h.id, h.hash);
     }
+  }
 
-    qInfo() << SRC_LOCATION << "Rendering image:" << filename;
+  int count = m_pendingIngest.size();
+  int cost = 0;
+  for(const IngestItem &item : m_pendingIngest) {
+    cost += item.cost;
   }
+  m_pendingIngest.clear();
+
+  m_ingestCount += count;
+  m_ingestLast.start();
+  qreal rate = m_ingestCount * 1000.0 / qMax<qint64>(1, m_ingestTimer.elapsed());
+  qInfo("Committed %d images (%.1f images/s)", count, rate);
+
+  emit ingestCommitted(count, cost);
+  emit ingestRateChanged(rate);
 
-  if(ric.flags & ImageDao::FNAME_TO_CLIPBOARD) {
-    emit setClipboard(clipBoardData.join('\n'));
+  for(const auto &w : written) {
+    emit writeComplete(w.first, w.second);
   }
 }
 
+// One thumbnail table per batch, each cleared and committed on its own.
 void ImageDaoDeferredWriter::task_clearThumbnailCache()
 {
+  setTaskPhase(QStringLiteral("Clearing thumbnails"), std::size(thumbnailSizes));
+
+  m_taskCursor = 0;
+  clearThumbnailBatch();
+}
+
+void ImageDaoDeferredWriter::clearThumbnailBatch()
+{
+  if(taskCancelled() || m_taskCursor >= (qint64)std::size(thumbnailSizes)) {
+    endTask();
+    return;
+  }
+
+  char sql[64];
+  snprintf(sql, sizeof sql, "DELETE FROM thumb%d", thumbnailSizes[m_taskCursor]);
+
+  endWrite();
   startWrite();
-  m_conn.exec("DELETE FROM thumb40");
-  m_conn.exec("DELETE FROM thumb80");
-  m_conn.exec("DELETE FROM thumb160");
-  m_conn.exec("DELETE FROM thumb320");
-  m_conn.exec("DELETE FROM thumb640");
-  m_conn.exec("DELETE FROM thumb1280");
+  if(!taskExec(sql) || !taskExec("PRAGMA incremental_vacuum") || !endWrite()) {
+    endTask();
+    return;
+  }
+
+  reportProgress(++m_taskCursor);
+  QMetaObject::invokeMethod(this, &ImageDaoDeferredWriter::clearThumbnailBatch, Qt::QueuedConnection);
+}
+
+static const QStringList &purgeStatements()
+{
+  static const QStringList statements = []() {
+    QStringList statements = {
+      QStringLiteral("DELETE FROM store WHERE id IN (SELECT value FROM json_each(?1))"),
+      QStringLiteral("DELETE FROM tag WHERE id IN (SELECT value FROM json_each(?1))"),
+    };
+    for(int size : thumbnailSizes) {
+      statements.append(QStringLiteral("DELETE FROM thumb%1 WHERE id IN (SELECT value FROM json_each(?1))").arg(size));
+    }
+    // last, the chunk query depends on it
+    statements.append(QStringLiteral("DELETE FROM image WHERE id IN (SELECT value FROM json_each(?1))"));
+    return statements;
+  }();
+  return statements;
 }
 
+// Deleted images are purged in chunks, each in its own short transaction
+// that also releases the freed pages, so the database file shrinks as the
+// purge progresses. Every chunk is a queued call of its own, queued edits
+// get through in between.
 void ImageDaoDeferredWriter::task_purgeDeletedImages()
 {
-  startWrite();
-  m_conn.exec("DELETE FROM store WHERE id IN (SELECT id FROM image WHERE deleted = 1)", SRC_LOCATION);
-  m_conn.exec("DELETE FROM tag WHERE id IN (SELECT id FROM image WHERE deleted = 1)", SRC_LOCATION);
-  m_conn.exec("DELETE FROM image WHERE deleted = 1", SRC_LOCATION);
-  endWrite();
-  qInfo("Purged %d images from the database", sqlite3_changes(m_conn.m_db));
+  qint64 total = 0;
+  {
+    auto ps = m_conn.prepare("SELECT count(*) FROM image WHERE deleted = 1");
+    if(ps.step(SRC_LOCATION)) {
+      total = ps.resultInteger(0);
+    }
+  }
+  setTaskPhase(QStringLiteral("Purging deleted images"), total);
+
+  m_taskDone = 0;
+  purgeBatch();
+}
+
+void ImageDaoDeferredWriter::purgeBatch()
+{
+  const int chunkSize = 256;
+
+  QList<qint64> ids;
+  if(!taskCancelled()) {
+    auto ps = m_conn.prepare("SELECT id FROM image WHERE deleted = 1 ORDER BY id LIMIT ?1");
+    ps.bind(1, chunkSize);
+    while(ps.step(SRC_LOCATION)) {
+      ids.append(ps.resultInteger(0));
+    }
+  }
+
+  bool ok = !ids.isEmpty();
+  if(ok) {
+    QString idArray = jsonIdArray(ids);
+    // the chunk gets a transaction of its own
+    endWrite();
+    startWrite();
+
+    // A failed statement rolls back the chunk, the remaining ones must not
+    // run outside of it. Stopping also avoids retrying the same ids forever.
+    for(const QString &sql : purgeStatements()) {
+      auto ps = m_conn.prepare(qUtf8Printable(sql));
+      ps.bind(1, idArray);
+      if(!taskExec(ps)) {
+        ok = false;
+        break;
+      }
+    }
+    if(!ok || !taskExec("PRAGMA incremental_vacuum") || !endWrite()) {
+      if(!taskCancelled()) {
+        qWarning("Purge stopped, the chunk starting at id %lld was rolled back", ids.first());
+      }
+      ok = false;
+    }
+  }
+
+  if(!ok) {
+    qInfo("Purged %lld images from the database", m_taskDone);
+    if(m_taskDone > 0) {
+      emit imagesPurged();
+    }
+    endTask();
+    return;
+  }
+
+  phashIndexRemove(std::vector<int64_t>(ids.cbegin(), ids.cend()));
+
+  m_taskDone += ids.size();
+  reportProgress(m_taskDone);
+  QMetaObject::invokeMethod(this, &ImageDaoDeferredWriter::purgeBatch, Qt::QueuedConnection);
 }
 
 void ImageDaoDeferredWriter::task_vacuum()
 {
+  setTaskPhase(QStringLiteral("Vacuuming"));
+
+  {
+    QMutexLocker lock(m_conn.writeLock());
+    // converts databases created before incremental vacuum was enabled
+    m_conn.exec("PRAGMA auto_vacuum = INCREMENTAL", SRC_LOCATION);
+    if(taskExec("VACUUM")) {
+      qInfo("Vacuum complete");
+    }
+  }
+  endTask();
+}
+
+// The snapshot may already contain some of the recorded changes, the
+// recorded values win. Anything else aborts the replay and the compaction.
+static int replaceOnConflict(void *, int conflict, sqlite3_changeset_iter *)
+{
+  switch(conflict) {
+  case SQLITE_CHANGESET_DATA:
+  case SQLITE_CHANGESET_CONFLICT:
+    return SQLITE_CHANGESET_REPLACE;
+  case SQLITE_CHANGESET_NOTFOUND:
+    return SQLITE_CHANGESET_OMIT;
+  default:
+    return SQLITE_CHANGESET_ABORT;
+  }
+}
+
+// Online variant of vacuum. A reader connection writes a compacted copy with
+// VACUUM INTO from its snapshot while commands keep being applied, a session
+// on the write connection records them. The recorded changes are replayed
+// onto the copy, which then replaces the database file. Writes only wait for
+// the replay and the swap, see SQLiteConnectionPool::replaceDatabase().
+void ImageDaoDeferredWriter::task_compact()
+{
+  setTaskPhase(QStringLiteral("Writing compacted copy"));
+
+  m_compactPath = QString::fromUtf8(sqlite3_db_filename(m_conn.m_db, "main")) + QStringLiteral(".compact");
+  QFile::remove(m_compactPath);
+
+  // backgroundTask() committed, everything after the snapshot is recorded
+  if(sqlite3session_create(m_conn.m_db, "main", &m_compactSession) != SQLITE_OK ||
+     sqlite3session_attach(m_compactSession, nullptr) != SQLITE_OK) {
+    qWarning("Couldn't record changes for compaction: %s", sqlite3_errmsg(m_conn.m_db));
+    discardCompaction();
+    endTask();
+    return;
+  }
+
+  m_taskReader = m_connPool->open();
+  m_workerPool.start([this, reader = m_taskReader.m_db, path = m_compactPath]() {
+    sqlite3_progress_handler(reader, 10000, &ImageDaoDeferredWriter::interruptHandler, this);
+    // converts databases created before incremental vacuum was enabled
+    sqlite3_exec(reader, "PRAGMA auto_vacuum = INCREMENTAL", nullptr, nullptr, nullptr);
+    SQLitePreparedStatement ps(reader, "VACUUM INTO ?1");
+    ps.bind(1, path);
+    bool ok = ps.exec(SRC_LOCATION);
+    sqlite3_progress_handler(reader, 0, nullptr, nullptr);
+
+    QMetaObject::invokeMethod(this, [this, ok]() { compactCopied(ok); }, Qt::QueuedConnection);
+  });
+}
+
+void ImageDaoDeferredWriter::compactCopied(bool ok)
+{
+  m_taskReader = SQLiteConnection();
+  if(!ok || taskCancelled()) {
+    discardCompaction();
+    endTask();
+    return;
+  }
+
+  setTaskPhase(QStringLiteral("Replaying changes"));
   endWrite();
-  startBusy();
 
-  QMutexLocker lock(m_conn.writeLock());
-  m_conn.exec("VACUUM", SRC_LOCATION);
-  qInfo("Vacuum complete");
+  int changesetSize = 0;
+  void *changeset = nullptr;
+  int rc = sqlite3session_changeset(m_compactSession, &changesetSize, &changeset);
+  sqlite3session_delete(m_compactSession);
+  m_compactSession = nullptr;
+
+  sqlite3 *copy = nullptr;
+  if(rc == SQLITE_OK) {
+    rc = sqlite3_open_v2(qUtf8Printable(m_compactPath), &copy, SQLITE_OPEN_READWRITE, nullptr);
+  }
+  if(rc == SQLITE_OK) {
+    rc = sqlite3changeset_apply(copy, changesetSize, changeset, nullptr, &replaceOnConflict, nullptr);
+  }
+  if(rc == SQLITE_OK) {
+    rc = sqlite3_exec(copy, "PRAGMA journal_mode = WAL", nullptr, nullptr, nullptr);
+  }
+  sqlite3_free(changeset);
+  sqlite3_close(copy);
+
+  if(rc != SQLITE_OK) {
+    qWarning("Compaction failed: %s", sqlite3_errstr(rc));
+    discardCompaction();
+    endTask();
+    return;
+  }
+
+  qInfo("Compacted copy complete, %d bytes of changes replayed", changesetSize);
+  setTaskPhase(QStringLiteral("Replacing database"));
+
+  // Nothing may be written between the replay and the swap. The connection
+  // goes back to the pool, so the pool can close it.
+  m_replacingDatabase = true;
+  m_conn = SQLiteConnection();
+  emit compactedCopyReady(m_compactPath);
 }
 
+void ImageDaoDeferredWriter::resumeAfterReplace(bool replaced)
+{
+  m_conn = m_connPool->open();
+  // a per connection setting, see startCheckpoints()
+  sqlite3_wal_autocheckpoint(m_conn.m_db, 0);
+  m_replacingDatabase = false;
+
+  if(replaced) {
+    qInfo("Compaction complete");
+  } else {
+    qWarning("Compaction abandoned, the database file was kept");
+  }
+
+  discardCompaction();
+  endTask();
+  QMetaObject::invokeMethod(this, &ImageDaoDeferredWriter::drainCommands, Qt::QueuedConnection);
+}
+
+void ImageDaoDeferredWriter::discardCompaction()
+{
+  if(m_compactSession != nullptr) {
+    sqlite3session_delete(m_compactSession);
+    m_compactSession = nullptr;
+  }
+  m_taskReader = SQLiteConnection();
+  if(!m_compactPath.isEmpty()) {
+    QFile::remove(m_compactPath);
+    m_compactPath.clear();
+  }
+}
+
+static const QString rehashCheckpointKey = QStringLiteral("rehashCheckpoint");
+static const int rehashBatchSize = 64;
+
+static std::vector<RehashItem> fetchRehashBatch(const SQLiteConnection &conn, qint64 afterId, int batchSize)
+{
+  std::vector<RehashItem> batch;
+  auto ps = conn.prepare("SELECT image.id, store.image FROM image JOIN store ON (store.id = image.id) WHERE image.id > ?1 ORDER BY image.id LIMIT ?2");
+  ps.bind(1, afterId);
+  ps.bind(2, batchSize);
+  while(ps.step(SRC_LOCATION)) {
+    QByteArray blob = ps.resultBlobPointer(1);
+    // deep copy, the blob pointer is only valid until the next step
+    batch.push_back({ ps.resultInteger(0), QByteArray(blob.constData(), blob.size()), {} });
+  }
+  return batch;
+}
+
+// Rehashing runs in bounded batches: the next batch is read from a reader
+// connection while the worker pool decodes the current one, then the results
+// are committed in a short write transaction together with a checkpoint in the
+// meta table, so an interrupted run resumes where it left off. Each batch is
+// a queued call, the cursor and the prefetched batch are kept in members.
 void ImageDaoDeferredWriter::task_fixImageMetaData()
 {
+  m_taskReader = m_conn.m_pool->open();
+
+  m_taskCursor = ImageDao::metaGet(m_conn, rehashCheckpointKey).toLongLong();
+  if(m_taskCursor > 0) {
+    qInfo("Resuming image metadata rebuild after id %lld", m_taskCursor);
+  }
+
+  qint64 total = 0;
+  qint64 done = 0;
+  {
+    auto ps = m_taskReader.prepare("SELECT count(*), count(CASE WHEN id <= ?1 THEN 1 END) FROM image");
+    ps.bind(1, m_taskCursor);
+    if(ps.step(SRC_LOCATION)) {
+      total = ps.resultInteger(0);
+      done = ps.resultInteger(1);
+    }
+  }
+
+  // the ETA only covers the images that are left
+  setTaskPhase(QStringLiteral("Rebuilding image metadata"), total - done);
+
+  m_taskDone = 0;
+  m_taskTimer.start();
+  m_rehashBatch = fetchRehashBatch(m_taskReader, m_taskCursor, rehashBatchSize);
+  rehashBatch();
+}
+
+void ImageDaoDeferredWriter::rehashBatch()
+{
+  if(m_rehashBatch.empty()) {
+    endWrite();
+    startWrite();
+    auto ps = m_conn.prepare("DELETE FROM meta WHERE key = ?1");
+    ps.bind(1, rehashCheckpointKey);
+    ps.exec(SRC_LOCATION);
+    endWrite();
+
+    qInfo("Rebuilt image metadata of %lld images in %lld ms", m_taskDone, m_taskTimer.elapsed());
+    m_taskReader = SQLiteConnection();
+    endTask();
+    return;
+  }
+
+  for(RehashItem &item : m_rehashBatch) {
+    m_workerPool.start([&item]() {
+      item.meta = computeImageMetaData(item.data);
+      item.data = QByteArray();
+    });
+  }
+
+  std::vector<RehashItem> next = fetchRehashBatch(m_taskReader, m_rehashBatch.back().id, rehashBatchSize);
+  m_workerPool.waitForDone();
+
+  endWrite();
   startWrite();
+  for(const RehashItem &item : m_rehashBatch) {
+    if(item.meta.valid) {
+      storeImageMetaData(&m_conn, item.meta, item.id);
+    } else {
+      qWarning("Failed to decode image %lld", item.id);
+    }
+  }
+  m_taskCursor = m_rehashBatch.back().id;
+  ImageDao::metaPut(m_conn, rehashCheckpointKey, m_taskCursor);
+  if(endWrite()) {
+    // images that failed to decode keep their old hash
+    std::vector<int64_t> ids;
+    for(const RehashItem &item : m_rehashBatch) {
+      if(item.meta.valid) {
+        ids.push_back(item.id);
+      }
+    }
+    phashIndexRemove(ids);
+    for(const RehashItem &item : m_rehashBatch) {
+      if(item.meta.valid) {
+        phashIndexInsert(item.id, item.meta.phash);
+      }
+    }
+  }
+
+  m_taskDone += m_rehashBatch.size();
+  reportProgress(m_taskDone);
+
+  if(taskCancelled()) {
+    qInfo("Image metadata rebuild cancelled after id %lld", m_taskCursor);
+    m_rehashBatch.clear();
+    m_taskReader = SQLiteConnection();
+    endTask();
+    return;
+  }
+
+  m_rehashBatch = std::move(next);
+  QMetaObject::invokeMethod(this, &ImageDaoDeferredWriter::rehashBatch, Qt::QueuedConnection);
+}
 
-  auto ps = m_conn.prepare("SELECT id FROM image ORDER BY id");
+static const int rekeyBatchSize = 64;
+
+static std::vector<RekeyItem> fetchRekeyBatch(const SQLiteConnection &conn, qint64 afterId, int keySize, int batchSize)
+{
+  std::vector<RekeyItem> batch;
+  // a stored SHA-256 makes the image data unnecessary
+  auto ps = conn.prepare("SELECT id, hash, sha256, CASE WHEN ?2 = 16 OR sha256 IS NULL THEN image END FROM store "
+                         "WHERE id > ?1 AND length(hash) != ?2 ORDER BY id LIMIT ?3");
+  ps.bind(1, afterId);
+  ps.bind(2, keySize);
+  ps.bind(3, batchSize);
   while(ps.step(SRC_LOCATION)) {
-    qint64 id = ps.resultInteger(0);
+    // deep copies, the blob pointers are only valid until the next step
+    QByteArray key = ps.resultBlobPointer(1);
+    QByteArray sha256 = ps.resultBlobPointer(2);
+    QByteArray data = ps.resultBlobPointer(3);
+    batch.push_back({ ps.resultInteger(0), QByteArray(key.constData(), key.size()),
+                      QByteArray(sha256.constData(), sha256.size()), QByteArray(data.constData(), data.size()) });
+  }
+  return batch;
+}
 
-    RawImageQuery riq(m_conn, id);
-    updateImageMetaData(&m_conn, riq.data, id);
+void ImageDaoDeferredWriter::task_useXxh3Keys()
+{
+  startRekey(ImageDao::Xxh3_128);
+}
+
+void ImageDaoDeferredWriter::task_useSha256Keys()
+{
+  startRekey(ImageDao::Sha256);
+}
+
+// Rewrites the store keys in batches, the same way as the metadata rebuild.
+// The new algorithm applies right away, so edits made in the meantime already
+// store new keys. Ingested images are held back until every key is rewritten
+// because the duplicate check needs all keys in one algorithm. Rows are picked
+// by key length, a cancelled run continues where it stopped.
+void ImageDaoDeferredWriter::startRekey(int algorithm)
+{
+  ImageDao::setContentHash((ImageDao::ContentHash)algorithm);
+  startWrite();
+  ImageDao::metaPut(m_conn, contentHashKey, algorithm == ImageDao::Xxh3_128 ? xxh3KeyName : QStringLiteral("sha256"));
+  endWrite();
+  emit contentHashChanged();
+  m_rekeying = true;
+
+  m_taskReader = m_conn.m_pool->open();
+  int keySize = algorithm == ImageDao::Xxh3_128 ? 16 : 32;
+
+  qint64 total = 0;
+  {
+    auto ps = m_taskReader.prepare("SELECT count(*) FROM store WHERE length(hash) != ?1");
+    ps.bind(1, keySize);
+    if(ps.step(SRC_LOCATION)) {
+      total = ps.resultInteger(0);
+    }
   }
+
+  setTaskPhase(algorithm == ImageDao::Xxh3_128 ? QStringLiteral("Rewriting keys as XXH3-128") : QStringLiteral("Rewriting keys as SHA-256"), total);
+
+  m_taskCursor = 0;
+  m_taskDone = 0;
+  m_taskTimer.start();
+  m_rekeyBatch = fetchRekeyBatch(m_taskReader, m_taskCursor, keySize, rekeyBatchSize);
+  rekeyBatch();
 }
 
+void ImageDaoDeferredWriter::rekeyBatch()
+{
+  int keySize = ImageDao::contentHash() == ImageDao::Xxh3_128 ? 16 : 32;
+
+  if(m_rekeyBatch.empty() || taskCancelled()) {
+    if(m_rekeyBatch.empty()) {
+      qInfo("Rewrote %lld image keys in %lld ms", m_taskDone, m_taskTimer.elapsed());
+    } else {
+      qInfo("Key rewrite cancelled after id %lld, run it again to finish", m_taskCursor);
+    }
+    m_rekeyBatch.clear();
+    m_taskReader = SQLiteConnection();
+    m_rekeying = false;
+    emit keysRewritten();
+    flushIngest();
+    endTask();
+    return;
+  }
+
+  for(RekeyItem &item : m_rekeyBatch) {
+    m_workerPool.start([&item]() {
+      ImageDao::convertKey(item.data, &item.key, &item.sha256);
+      item.data = QByteArray();
+    });
+  }
+
+  std::vector<RekeyItem> next = fetchRekeyBatch(m_taskReader, m_rekeyBatch.back().id, keySize, rekeyBatchSize);
+  m_workerPool.waitForDone();
+
+  endWrite();
+  startWrite();
+  {
+    // rows recompressed in the meantime already carry a new key
+    auto ps = m_conn.prepare("UPDATE OR IGNORE store SET hash = ?1, sha256 = NULLIF(?2, x'') WHERE id = ?3 AND length(hash) != ?4");
+    ps.bind(4, keySize);
+    for(const RekeyItem &item : m_rekeyBatch) {
+      ps.bind(1, item.key);
+      ps.bind(2, item.sha256);
+      ps.bind(3, item.id);
+      ps.exec(SRC_LOCATION);
+      if(sqlite3_changes(m_conn.m_db) == 0) {
+        qWarning("Key of image %lld not rewritten", item.id);
+      }
+    }
+  }
+  endWrite();
+
+  m_taskCursor = m_rekeyBatch.back().id;
+  m_taskDone += m_rekeyBatch.size();
+  reportProgress(m_taskDone);
+
+  m_rekeyBatch = std::move(next);
+  QMetaObject::invokeMethod(this, &ImageDaoDeferredWriter::rekeyBatch, Qt::QueuedConnection);
+}
 
 QImage RawImageQuery::decode(const QSize &size) {
   QBuffer buffer(&data);
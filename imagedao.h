@@ -4,6 +4,10 @@
 #include "sqlitehelper.h"
 #include "imagemetadata.h"
 #include "imageref.h"
+#include "imageingest.h"
+#include "mpscqueue.h"
+#include "imageimporter.h"
+#include "imageexporter.h"
 
 #include <QObject>
 #include <QVariantMap>
@@ -15,6 +19,20 @@
 #include <QThread>
 #include <QTimer>
 #include <QReadWriteLock>
+#include <QThreadPool>
+#include <QAtomicInt>
+#include <QPointer>
+#include <QHash>
+#include <QFuture>
+#include <QJSValue>
+
+#include <variant>
+#include <vector>
+
+struct sqlite3_session;
+
+// Sizes of the cached thumbnail tables, thumbnails fill a square box.
+constexpr int thumbnailSizes[] = { 40, 80, 160, 320, 640, 1280 };
 
 struct RawImageQuery {
   SQLitePreparedStatement ps;
@@ -29,78 +47,321 @@ struct RawImageQuery {
   QImage decode(const QSize &size = {});
 };
 
-struct ImageRenderContext {
-  QList<QObject *> irefs;
-  QString path;
-  QSize size;
-  int flags;
+struct RehashItem {
+  qint64 id;
+  QByteArray data;
+  ImageMetaData meta;
+};
+
+struct RekeyItem {
+  qint64 id;
+  QByteArray key;
+  QByteArray sha256;
+  QByteArray data;
+};
+
+// Commands are applied by priority, user edits first and thumbnail cache
+// fills last.
+enum class WritePriority {
+  UserEdit,
+  Ingest,
+  Cache,
+};
+
+struct MetaPutCommand {
+  QString key;
+  QVariant value;
+};
+
+struct ThumbnailCommand {
+  qint64 id;
+  int size;
+  QByteArray data;
+};
+
+struct TagCommand {
+  QList<qint64> ids;
+  QStringList tags;
+  bool add;
+};
+
+struct DeletedCommand {
+  QList<qint64> ids;
+  bool deleted;
+};
+
+struct CompressCommand {
+  QList<qint64> ids;
 };
 
+using WriteCommand = std::variant<MetaPutCommand, ThumbnailCommand, IngestItem, TagCommand, DeletedCommand, CompressCommand, ExportManifestCommand>;
+
+// The write actor, the only owner of the write lock. Commands are plain
+// values that can be submitted from any thread, each priority has its own
+// lock-free queue. They are applied in slices so queued slot calls get a
+// turn in between. Writes are grouped into one transaction until the commit
+// latency has passed or the row limit is reached, whichever comes first. The
+// hard cap on how long a transaction stays open is checked between commands
+// and between the steps of long commands. A single statement, like one of the
+// bulk deletes of a task, can still run past it.
 class ImageDaoDeferredWriter : public QObject {
   Q_OBJECT
 
+  static constexpr int priorityCount = 3;
+  static constexpr int drainSlice = 32;
+  static constexpr int checkpointInterval = 1000;
+  static constexpr int checkpointIdleTime = 5000;
+  static constexpr qint64 checkpointPassiveSize = 16 * 1024 * 1024;
+
   void startWrite();
+  void rollbackWrite();
+  void checkCommit();
+
+  // Task reporting, used by the task_* slots and long running commands. Long
+  // tasks are split into batches, every batch is a queued call so commands
+  // and timers run in between, and the last one calls endTask().
+  void beginTask(const QString &name);
+  void setTaskPhase(const QString &phase, qint64 total = 0);
+  void reportProgress(qint64 done, bool force = false);
+  void endTask();
+  bool taskCancelled() const { return m_cancelRequested.loadRelaxed(); }
+  bool taskExec(const char *sql);
+  bool taskExec(const SQLitePreparedStatement &ps);
+  static int interruptHandler(void *writer);
+  void clearThumbnailBatch();
+  void purgeBatch();
+  void rehashBatch();
+  void startRekey(int algorithm);
+  void rekeyBatch();
+  void compactCopied(bool ok);
+  void discardCompaction();
+
+  void updateCommitStats(int rows);
   void startBusy();
+  bool popCommand(WriteCommand &command);
+  void apply(WriteCommand &command);
+  void insertImage(const IngestItem &item);
+  void updateTags(const TagCommand &command);
+  void updateDeleted(const DeletedCommand &command);
+  void compressImages(const CompressCommand &command);
+  void updateExportManifest(const ExportManifestCommand &command);
 
   SQLiteConnection m_conn;
+  SQLiteConnectionPool *m_connPool;
+  QTimer m_commitTimer;
+  QElapsedTimer m_transactionTimer;
+  int m_transactionChanges = 0;
+  QAtomicInt m_commitLatency = 10;
+  QAtomicInt m_commitRowLimit = 1000;
+  QAtomicInt m_commitMaxOpen = 500;
+  QElapsedTimer m_commitStatsTimer;
+  QTimer m_commitStatsTick;
+  bool m_commitStatsIdle = false;
+  int m_commitStatsCommits = 0;
+  qint64 m_commitStatsRows = 0;
+  QTimer m_checkpointTimer;
+  QString m_walPath;
+  QElapsedTimer m_activityClock;
+  std::atomic<qint64> m_lastActivity { 0 };
+  int m_commitsSinceCheckpoint = 0;
+  MpscQueue<WriteCommand> m_commands[priorityCount];
+  std::atomic<bool> m_drainScheduled { false };
+  QThreadPool m_workerPool;
+  QAtomicInt m_cancelRequested;
   bool m_inTransaction = false;
   bool m_busy = false;
+  bool m_taskRunning = false;
+  QString m_taskName;
+  QString m_taskPhase;
+  qint64 m_taskTotal = 0;
+  QElapsedTimer m_taskPhaseTimer;
+  QElapsedTimer m_taskReportTimer;
+  QElapsedTimer m_taskTimer;
+  qint64 m_taskDone = 0;
+  qint64 m_taskCursor = 0;
+  SQLiteConnection m_taskReader;
+  std::vector<RehashItem> m_rehashBatch;
+  std::vector<RekeyItem> m_rekeyBatch;
+  // Set while store keys are rewritten, ingested images wait in
+  // m_pendingIngest until the new algorithm is in place.
+  bool m_rekeying = false;
+  sqlite3_session *m_compactSession = nullptr;
+  QString m_compactPath;
+  // Set while the database file is replaced, m_conn is given back then and
+  // commands wait in their queues.
+  bool m_replacingDatabase = false;
+
+  QList<IngestItem> m_pendingIngest;
+  QElapsedTimer m_ingestTimer;
+  QElapsedTimer m_ingestLast;
+  qint64 m_ingestCount = 0;
+  int m_ingestBatchSize = 256;
 public:
   ImageDaoDeferredWriter(SQLiteConnection &&conn, QObject *parent = nullptr);
   virtual ~ImageDaoDeferredWriter();
+
+  // Thread safe, long running tasks poll this between batches.
+  void cancel() { m_cancelRequested.storeRelaxed(1); }
+
+  // Thread safe.
+  void submit(WritePriority priority, WriteCommand command);
+  void setCommitLatency(int ms) { m_commitLatency.storeRelaxed(ms); }
+  int commitLatency() const { return m_commitLatency.loadRelaxed(); }
+  void setCommitRowLimit(int rows) { m_commitRowLimit.storeRelaxed(rows); }
+  int commitRowLimit() const { return m_commitRowLimit.loadRelaxed(); }
+  void setCommitMaxOpen(int ms) { m_commitMaxOpen.storeRelaxed(ms); }
+  int commitMaxOpen() const { return m_commitMaxOpen.loadRelaxed(); }
+  // Thread safe, postpones the idle checkpoint.
+  void noteActivity() { m_lastActivity.store(m_activityClock.elapsed(), std::memory_order_relaxed); }
 private slots:
-  void endWrite();
+  bool endWrite();
+  void checkpoint();
+  void publishCommitStats();
   void endBusy();
+  void flushIngest();
+  void drainCommands();
 public slots:  
 
   void backgroundTask(const QString &name);
-
-  void addTag(const QList<QObject *> &irefs, const QString &tag);
-  void removeTag(const QList<QObject *> &irefs, const QString &tag);
-  void updateDeleted(const QList<QObject *> &irefs, bool deleted);
-  void compressImages(const QList<QObject *> &irefs);
-  void writeImage(const QUrl &url, const QByteArray &data);
-  void renderImages(const ImageRenderContext &ric);
+  void sync();
+  void startCheckpoints();
+  void startCommitStats();
 
   void task_clearThumbnailCache();
   void task_fixImageMetaData();
   void task_purgeDeletedImages();
   void task_vacuum();
+  void task_compact();
+  void task_useXxh3Keys();
+  void task_useSha256Keys();
+  void resumeAfterReplace(bool replaced);
 signals:
-  void updateImageData(ImageRef *update, const QString &newFormat, qint64 newFileSize, QImage::Format newPixelFormat);
+  void updateImageData(qint64 id, const QString &newFormat, qint64 newFileSize, QImage::Format newPixelFormat);
   void writeComplete(const QUrl &url, quint64 fileId);
-  void setClipboard(const QString &data);
   void busyChanged(bool busyState);
+  void progressChanged(qint64 done, qint64 total);
+  void taskStatusChanged(const QString &name, const QString &phase, qint64 done, qint64 total, qint64 etaMs);
+  void taskFinished(const QString &name);
+  void ingestCommitted(int count, int cost);
+  void imagesPurged();
+  void ingestRateChanged(qreal imagesPerSecond);
+  void commitStatsChanged(qreal commitsPerSecond, qreal rowsPerCommit);
+  void checkpointStatsChanged(qint64 walSize, qint64 durationMs);
+  void compactedCopyReady(const QString &path);
+  void contentHashChanged();
+  void keysRewritten();
 };
 
 
-Q_DECLARE_METATYPE(ImageRenderContext)
-
 class ImageDao : public QObject
 {
   Q_OBJECT
   Q_PROPERTY(bool busy READ busy NOTIFY busyChanged)
+  Q_PROPERTY(qreal progress READ progress NOTIFY busyChanged)
+  Q_PROPERTY(int ingestQueued READ ingestQueued NOTIFY ingestChanged)
+  Q_PROPERTY(qreal ingestRate READ ingestRate NOTIFY ingestChanged)
+  Q_PROPERTY(int commitLatency READ commitLatency WRITE setCommitLatency NOTIFY commitPolicyChanged)
+  Q_PROPERTY(int commitRowLimit READ commitRowLimit WRITE setCommitRowLimit NOTIFY commitPolicyChanged)
+  Q_PROPERTY(int commitMaxOpen READ commitMaxOpen WRITE setCommitMaxOpen NOTIFY commitPolicyChanged)
+  Q_PROPERTY(qreal commitsPerSecond READ commitsPerSecond NOTIFY commitStatsChanged)
+  Q_PROPERTY(qreal rowsPerCommit READ rowsPerCommit NOTIFY commitStatsChanged)
+  Q_PROPERTY(qint64 walSize READ walSize NOTIFY checkpointStatsChanged)
+  Q_PROPERTY(qint64 lastCheckpointDuration READ lastCheckpointDuration NOTIFY checkpointStatsChanged)
+  Q_PROPERTY(QString taskName READ taskName NOTIFY taskStatusChanged)
+  Q_PROPERTY(QString taskPhase READ taskPhase NOTIFY taskStatusChanged)
+  Q_PROPERTY(qint64 taskDone READ taskDone NOTIFY taskStatusChanged)
+  Q_PROPERTY(qint64 taskTotal READ taskTotal NOTIFY taskStatusChanged)
+  Q_PROPERTY(qint64 taskEta READ taskEta NOTIFY taskStatusChanged)
+  Q_PROPERTY(ContentHash contentHash READ contentHash NOTIFY contentHashChanged)
 
   static ImageDao *m_instance;
   static QString m_databaseFilename;
+  static QAtomicInt m_contentHash;
 
   SQLiteConnectionPool m_connPool;
   SQLiteConnection m_conn;
 
   QThread m_writeThread;
-  QMap<quint64, ImageRef *> m_refMap;
+  ImageDaoDeferredWriter *m_writer;
+  ImageIngestPipeline m_ingest;
+  QPointer<ImageImporter> m_importer;
+  QPointer<ImageExporter> m_exporter;
+
+  struct PendingExport {
+    ImageRenderContext irc;
+    QStringList clipBoardData;
+  };
+
+  // Exports requested while another one runs, started in order.
+  QList<PendingExport> m_pendingExports;
+  void startExport(const ImageRenderContext &irc, const QStringList &clipBoardData);
+  // Paths dropped while an import runs, imported together once it finishes.
+  QStringList m_pendingImports;
+  void startImport(const QStringList &paths);
+  QHash<qint64, ImageRef *> m_refMap;
   QReadWriteLock m_refMapLock;
   QImage makeThumbnail(SQLiteConnection *conn, ImageRef *iref, int thumbsize, volatile bool *cancelled);
 
   bool m_busy = false;
+  qreal m_progress = -1;
+  qreal m_ingestRate = 0;
+  qreal m_commitsPerSecond = 0;
+  qreal m_rowsPerCommit = 0;
+  qint64 m_walSize = 0;
+  qint64 m_lastCheckpointDuration = -1;
+  QString m_taskName;
+  QString m_taskPhase;
+  qint64 m_taskDone = 0;
+  qint64 m_taskTotal = 0;
+  qint64 m_taskEta = -1;
+
+  enum ChangeFlags {
+    TagsChanged = 0x1,
+    DeletedChanged = 0x2,
+  };
+
+  struct PendingChange {
+    QPointer<ImageRef> iref;
+    int flags = 0;
+  };
+
+  // Per image notifications are collected and emitted once per event loop
+  // iteration, so bulk edits don't flood the views. Refs can be collected by
+  // the QML engine in the meantime, hence the guarded pointer.
+  QHash<ImageRef *, PendingChange> m_pendingChanges;
+  void markChanged(ImageRef *iref, int flags);
+  void emitChanges();
+  QList<QObject *> updateTags(const QList<QObject *> &irefs, const QStringList &tags, bool add);
+
+  // Read queries, usable with any connection from the pool.
+  QList<QObject *> queryAll(const SQLiteConnection &conn, bool includeDeleted);
+  ImageRef *queryImageRef(const SQLiteConnection &conn, qint64 id);
+  static QStringList queryTags(const SQLiteConnection &conn, qint64 id);
+
+  QThreadPool m_readerPool;
+  template <typename F>
+  auto runRead(F &&query);
+  template <typename T>
+  void callWhenReady(const QFuture<T> &future, const QJSValue &callback);
 public:
   enum RenderFlags {
     PAD_TO_FIT = 0x01,
     FNAME_TO_CLIPBOARD = 0x2,
+    SYNC_EXPORT = 0x4,
   };
 
   Q_ENUM(RenderFlags)
 
+  // Algorithm of the store.hash key. SHA-256 keys are 32 bytes and XXH3-128
+  // keys 16, so a key tells which one produced it. Next to an XXH3-128 key the
+  // SHA-256 is kept in store.sha256 to verify the content.
+  enum ContentHash {
+    Sha256,
+    Xxh3_128,
+  };
+
+  Q_ENUM(ContentHash)
+
   explicit ImageDao(QObject *parent = nullptr);
   virtual ~ImageDao();
 
@@ -108,12 +369,20 @@ public:
 
   bool tableExists(const QString &table);
 
+  // Applied asynchronously by the writer.
   Q_INVOKABLE void metaPut(const QString &key, const QVariant &val);
   Q_INVOKABLE QVariant metaGet(const QString &key);
+  static void metaPut(const SQLiteConnection &conn, const QString &key, const QVariant &val);
+  static QVariant metaGet(const SQLiteConnection &conn, const QString &key);
 
+  // Return the images that were changed.
+  Q_INVOKABLE QList<QObject *> addTags(const QList<QObject *> &irefs, const QStringList &tags);
+  Q_INVOKABLE QList<QObject *> removeTags(const QList<QObject *> &irefs, const QStringList &tags);
+  Q_INVOKABLE QList<QObject *> setDeleted(const QList<QObject *> &irefs, bool deleted);
   Q_INVOKABLE QList<QObject *> addTag(const QList<QObject *> &irefs, const QString &tag);
   Q_INVOKABLE QList<QObject *> removeTag(const QList<QObject *> &irefs, const QString &tag);
-  Q_INVOKABLE QList<QObject *> findAllDuplicates(const QList<QObject *> &irefs, int maxDuplicates = 5);
+  Q_INVOKABLE QList<QObject *> findAllDuplicates(const QList<QObject *> &irefs, int maxDuplicates = 5, bool cascaded = false);
+  Q_INVOKABLE QList<QObject *> findSimilar(qint64 id, int k = 50, int maxDistance = 12);
   Q_INVOKABLE QVariantList tagCount(const QList<QObject *> &irefs);
   Q_INVOKABLE QList<QObject *> search(const QList<QObject *> &irefs, const QStringList &tags);
   Q_INVOKABLE QList<QObject *> all(bool includeDeleted);
@@ -121,36 +390,108 @@ public:
   Q_INVOKABLE ImageRef *createImageRef(qint64 id);
   Q_INVOKABLE void compressImages(const QList<QObject *> &irefs);
 
+  // Asynchronous variants of the read API, run on the reader pool with their
+  // own connection. The QML overloads call back on the GUI thread.
+  QFuture<QList<QObject *>> allAsync(bool includeDeleted);
+  QFuture<ImageRef *> createImageRefAsync(qint64 id);
+  QFuture<QStringList> tagsByIdAsync(qint64 id);
+  QFuture<QVariant> metaGetAsync(const QString &key);
+  QFuture<QList<QObject *>> findAllDuplicatesAsync(const QList<QObject *> &irefs, int maxDuplicates, bool cascaded);
+  Q_INVOKABLE void allAsync(bool includeDeleted, const QJSValue &callback);
+  Q_INVOKABLE void createImageRefAsync(qint64 id, const QJSValue &callback);
+  Q_INVOKABLE void tagsByIdAsync(qint64 id, const QJSValue &callback);
+  Q_INVOKABLE void metaGetAsync(const QString &key, const QJSValue &callback);
+  Q_INVOKABLE void findAllDuplicatesAsync(const QList<QObject *> &irefs, int maxDuplicates, bool cascaded, const QJSValue &callback);
+
 
   Q_INVOKABLE QList<QObject *> updateDeleted(const QList<QObject *> &irefs, bool deleted);
 
   Q_INVOKABLE void renderImages(const QList<QObject *> &irefs, const QString &path, int requestedSize, int flags);
 
   Q_INVOKABLE void backgroundTask(const QString &name);
+  Q_INVOKABLE void cancelBackgroundTask();
+  // Blocks until every submitted write is committed.
+  void sync();
 
   QImage requestImage(qint64 id, const QSize &requestedSize, volatile bool *cancelled);
 
+  // Thread safe, blocks while the ingest pipeline is full.
+  // The content hash is computed when not given, a given SHA-256 is also
+  // accepted while the store uses XXH3-128 keys.
+  void ingestImage(const QUrl &url, const QByteArray &data, std::shared_ptr<const void> keepAlive = {}, const QByteArray &hash = QByteArray());
+
+  // Imports files, directories and archives on a separate thread. Paths
+  // given while an import runs are imported after it.
+  Q_INVOKABLE bool importPaths(const QStringList &paths);
+
   static void setDatabaseFilename(const QString &filename);
-  static QString imageHash(const QByteArray &data);
+  // Store key of data in the current or the given algorithm.
+  static QByteArray imageHash(const QByteArray &data);
+  static QByteArray imageHash(const QByteArray &data, ContentHash algorithm);
+  // SHA-256 of data unless key already is one.
+  static QByteArray verificationHash(const QByteArray &data, const QByteArray &key);
+  // Brings a key and its verification hash to the current algorithm, a
+  // SHA-256 is reused rather than computed again.
+  static void convertKey(const QByteArray &data, QByteArray *key, QByteArray *sha256);
+  static ContentHash keyAlgorithm(const QByteArray &key) { return key.size() == 16 ? Xxh3_128 : Sha256; }
+  static ContentHash contentHash() { return (ContentHash)m_contentHash.loadRelaxed(); }
+  static void setContentHash(ContentHash algorithm) { m_contentHash.storeRelaxed(algorithm); }
   static ImageDao *instance();
 
   bool busy() const { return m_busy; }
+  qreal progress() const { return m_progress; }
+  int ingestQueued() const { return m_ingest.queued(); }
+  ImageIngestPipeline *ingestPipeline() { return &m_ingest; }
+  int ingestSkipped() const { return m_ingest.skipped(); }
+  qreal ingestRate() const { return m_ingestRate; }
+  int commitLatency() const { return m_writer->commitLatency(); }
+  void setCommitLatency(int ms);
+  int commitRowLimit() const { return m_writer->commitRowLimit(); }
+  void setCommitRowLimit(int rows);
+  int commitMaxOpen() const { return m_writer->commitMaxOpen(); }
+  void setCommitMaxOpen(int ms);
+  qreal commitsPerSecond() const { return m_commitsPerSecond; }
+  qreal rowsPerCommit() const { return m_rowsPerCommit; }
+  qint64 walSize() const { return m_walSize; }
+  qint64 lastCheckpointDuration() const { return m_lastCheckpointDuration; }
+  QString taskName() const { return m_taskName; }
+  QString taskPhase() const { return m_taskPhase; }
+  qint64 taskDone() const { return m_taskDone; }
+  qint64 taskTotal() const { return m_taskTotal; }
+  qint64 taskEta() const { return m_taskEta; }
 public slots:
   void setBusy(bool busyState);
-  void updateImageData(ImageRef *update, const QString &newFormat, qint64 newFileSize, QImage::Format newPixelFormat);
+  void setProgress(qint64 done, qint64 total);
+  void setIngestRate(qreal imagesPerSecond);
+  void setCommitStats(qreal commitsPerSecond, qreal rowsPerCommit);
+  void setCheckpointStats(qint64 walSize, qint64 durationMs);
+  void setTaskStatus(const QString &name, const QString &phase, qint64 done, qint64 total, qint64 etaMs);
+  void setImportProgress(qint64 done, qint64 total);
+  void updateImageData(qint64 id, const QString &newFormat, qint64 newFileSize, QImage::Format newPixelFormat);
   void setClipboard(const QString &data);
+  void replaceDatabase(const QString &path);
 signals:
   void deferredBackgroundTask(const QString &name);
-  void deferredUpdateDeleted(const QList<QObject *> &irefs, bool deleted);
-  void deferredAddTag(const QList<QObject *> &irefs, const QString &tag);
-  void deferredRemoveTag(const QList<QObject *> &irefs, const QString &tag);
-  void deferredCompressImages(const QList<QObject *> &irefs);
-  void deferredRenderImages(const ImageRenderContext &ric);
+  void databaseReplaced(bool replaced);
+  void contentHashChanged();
+  // Emitted first thing on destruction, producers feeding ingestImage()
+  // from other threads must stop before the ingest pool is drained.
+  void aboutToShutDown();
 
-  void deferredWriteImage(const QUrl &url, const QByteArray &data);  
   void writeComplete(const QUrl &url, qint64 id);
 
   void busyChanged();
+  void ingestChanged();
+  void commitPolicyChanged();
+  void commitStatsChanged();
+  void checkpointStatsChanged();
+  void taskProgress(qint64 done, qint64 total);
+  void taskStatusChanged();
+  void taskFinished(const QString &name);
+  void importProgress(qint64 done, qint64 total);
+  void importFinished(qint64 imported, qint64 skipped, qint64 failed);
+  void exportFinished(qint64 written, qint64 failed);
+  void imagesChanged(const QList<QObject *> &irefs);
 public slots:
 };
 
@@ -0,0 +1,434 @@
+#include "imageexporter.h"
+#include "imagedao.h"
+#include "archive.h"
+#include "sqlite3.h"
+
+#include <QBuffer>
+#include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QImageReader>
+#include <QPainter>
+#include <QSaveFile>
+#include <QSet>
+#include <QWaitCondition>
+
+#include <vector>
+
+ImageExporter::ImageExporter(const ImageRenderContext &ric, QObject *parent) : QObject(parent), m_ric(ric)
+{
+}
+
+static QString formatToExtension(QString format) {
+  if(format == QStringLiteral("jpeg")) {
+    return QStringLiteral("jpg");
+  }
+
+  return format;
+}
+
+// Decodes an image scaled to fit reqSize. The smallest cached thumbnail that
+// covers reqSize is used when there is one. Otherwise the original is read,
+// JPEG originals are decoded directly at the target size.
+static QImage decodeScaled(const SQLiteConnection &conn, const RenderItem &item, const QSize &reqSize)
+{
+  // Thumbnails have transparency flattened onto the view background, an
+  // export has to come out the same at every size. An unknown pixel format
+  // may have alpha as well.
+  bool mayHaveAlpha = item.pixelFormat == QImage::Format_Invalid ||
+      QImage::toPixelFormat(item.pixelFormat).alphaUsage() == QPixelFormat::UsesAlpha;
+
+  if(!mayHaveAlpha) {
+    for(int tsize : thumbnailSizes) {
+      if(tsize < reqSize.width() || tsize < reqSize.height())
+        continue;
+
+      // a thumbnail of a smaller original would be upscaled
+      if(item.size.width() < tsize || item.size.height() < tsize)
+        break;
+
+      char sql[64];
+      snprintf(sql, sizeof sql, "SELECT image FROM thumb%d WHERE id = ?1", tsize);
+      auto ps = conn.prepare(sql);
+      ps.bind(1, item.id);
+      if(ps.step(SRC_LOCATION)) {
+        QByteArray thumbData = ps.resultBlobPointer(0);
+        QBuffer buffer(&thumbData);
+        QImageReader reader(&buffer);
+        QImage image = reader.read();
+        if(!image.isNull())
+          return image.scaled(reqSize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+      }
+    }
+  }
+
+  RawImageQuery riq(conn, item.id);
+  if(riq.data.isEmpty())
+    return QImage();
+
+  QBuffer buffer(&riq.data);
+  QImageReader reader(&buffer);
+  QSize target = reader.size().scaled(reqSize, Qt::KeepAspectRatio);
+  if(reader.format() == "jpeg" && !target.isEmpty()) {
+    reader.setScaledSize(target);
+  }
+
+  QImage image = reader.read();
+  if(image.isNull() || image.size() == target)
+    return image;
+
+  return image.scaled(reqSize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+}
+
+QString ImageExporter::fileName(const RenderItem &item) const
+{
+  QString effectiveFormat = m_ric.size.isValid() ? QStringLiteral("jpeg") : item.format;
+  return QString(item.basename).append('.').append(formatToExtension(effectiveFormat));
+}
+
+QImage ImageExporter::renderImage(const SQLiteConnection &conn, const RenderItem &item) const
+{
+  const QSize &reqSize = m_ric.size;
+
+  QImage image = decodeScaled(conn, item, reqSize);
+  if(image.isNull()) {
+    qWarning("Failed to decode image %lld", item.id);
+    return image;
+  }
+
+  if(m_ric.flags & ImageDao::PAD_TO_FIT) {
+    QImage surface(reqSize, QImage::Format_RGB32);
+    surface.fill(Qt::black);
+    QPainter painter(&surface);
+    painter.drawImage((surface.width() - image.width()) / 2, (surface.height() - image.height()) / 2, image);
+    painter.end();
+    image = surface;
+  }
+
+  return image;
+}
+
+bool ImageExporter::renderItem(const RenderItem &item, const QString &filename)
+{
+  qInfo() << SRC_LOCATION << "Rendering image:" << filename;
+
+  SQLiteConnection conn = ImageDao::instance()->connPool()->open();
+
+  if(!m_ric.size.isValid()) {
+    RawImageQuery riq(conn, item.id);
+    if(riq.data.isEmpty()) {
+      qWarning("Image %lld not found", item.id);
+      return false;
+    }
+
+    QFile file(filename);
+    return file.open(QIODevice::WriteOnly | QIODevice::Truncate) && file.write(riq.data) == riq.data.size();
+  }
+
+  QImage image = renderImage(conn, item);
+  return !image.isNull() && image.save(filename, "jpeg", 95);
+}
+
+// Streams an original from the store into the archive with incremental blob
+// reads, so only one chunk of it is in memory. Returns false when the archive
+// can't be written, a missing image only counts as failed.
+bool ImageExporter::archiveOriginal(ArchiveWriter &archive, const SQLiteConnection &conn, const RenderItem &item, QByteArray &buffer)
+{
+  sqlite3_blob *blob = nullptr;
+  if(sqlite3_blob_open(conn.m_db, "main", "store", "image", item.id, 0, &blob) != SQLITE_OK) {
+    qWarning("Image %lld not found: %s", item.id, sqlite3_errmsg(conn.m_db));
+    sqlite3_blob_close(blob);
+    m_failed.fetchAndAddRelaxed(1);
+    return true;
+  }
+
+  int size = sqlite3_blob_bytes(blob);
+  bool ok = archive.beginMember(fileName(item), size);
+  for(int offset = 0; ok && offset < size; offset += buffer.size()) {
+    int length = qMin<int>(buffer.size(), size - offset);
+    if(sqlite3_blob_read(blob, buffer.data(), length, offset) != SQLITE_OK) {
+      qWarning("Failed to read image %lld: %s", item.id, sqlite3_errmsg(conn.m_db));
+      ok = false;
+      break;
+    }
+    ok = archive.write(buffer.constData(), length);
+  }
+  sqlite3_blob_close(blob);
+
+  return ok && archive.endMember();
+}
+
+void ImageExporter::writeArchive()
+{
+  QElapsedTimer timer;
+  timer.start();
+
+  qint64 total = m_ric.items.size();
+  auto reportProgress = [&]() {
+    qint64 done = m_done.loadRelaxed();
+    emit progress(done, total, done * 1000.0 / qMax<qint64>(1, timer.elapsed()));
+  };
+
+  QFileInfo(m_ric.path).dir().mkpath(QStringLiteral("."));
+  QSaveFile file(m_ric.path);
+  if(!file.open(QIODevice::WriteOnly)) {
+    qWarning() << "Failed to create archive" << m_ric.path << file.errorString();
+    emit finished(0, total);
+    return;
+  }
+
+  ArchiveWriter archive(&file, m_ric.path.endsWith(QStringLiteral(".zip"), Qt::CaseInsensitive));
+  bool ok = true;
+  QElapsedTimer reportTimer;
+  reportTimer.start();
+
+  if(!m_ric.size.isValid()) {
+    QByteArray buffer(256 * 1024, Qt::Uninitialized);
+
+    for(const RenderItem &item : m_ric.items) {
+      if(m_cancelled.loadRelaxed())
+        break;
+
+      // borrowed per image, so the pool can replace the database in between
+      SQLiteConnection conn = ImageDao::instance()->connPool()->open();
+      ok = archiveOriginal(archive, conn, item, buffer);
+      if(!ok)
+        break;
+      m_done.fetchAndAddRelaxed(1);
+
+      if(reportTimer.hasExpired(100)) {
+        reportProgress();
+        reportTimer.restart();
+      }
+    }
+  } else {
+    // Renders are encoded on the worker pool a bounded number of images ahead
+    // of this thread, which appends them to the archive in selection order.
+    struct Encoded {
+      QByteArray data;
+      bool ready = false;
+    };
+
+    std::vector<Encoded> encoded(m_ric.items.size());
+    QMutex lock;
+    QWaitCondition readyCondition;
+    qsizetype window = m_workerPool.maxThreadCount() * 2;
+    qsizetype submitted = 0;
+
+    for(qsizetype i = 0; i < m_ric.items.size(); i++) {
+      for(; submitted < m_ric.items.size() && submitted < i + window; submitted++) {
+        m_workerPool.start([this, &encoded, &lock, &readyCondition, index = submitted]() {
+          QByteArray data;
+          if(!m_cancelled.loadRelaxed()) {
+            SQLiteConnection conn = ImageDao::instance()->connPool()->open();
+            QImage image = renderImage(conn, m_ric.items.at(index));
+            if(!image.isNull()) {
+              QBuffer buffer(&data);
+              buffer.open(QIODevice::WriteOnly);
+              image.save(&buffer, "jpeg", 95);
+            }
+          }
+
+          QMutexLocker locker(&lock);
+          encoded[index].data = std::move(data);
+          encoded[index].ready = true;
+          readyCondition.wakeAll();
+        });
+      }
+
+      QMutexLocker locker(&lock);
+      while(!encoded[i].ready) {
+        if(!readyCondition.wait(&lock, 100)) {
+          locker.unlock();
+          reportProgress();
+          locker.relock();
+        }
+      }
+      QByteArray data = std::move(encoded[i].data);
+      locker.unlock();
+
+      if(m_cancelled.loadRelaxed())
+        break;
+
+      if(data.isEmpty()) {
+        m_failed.fetchAndAddRelaxed(1);
+      } else {
+        ok = archive.beginMember(fileName(m_ric.items.at(i)), data.size()) && archive.write(data.constData(), data.size()) && archive.endMember();
+        if(!ok)
+          break;
+      }
+      m_done.fetchAndAddRelaxed(1);
+
+      if(reportTimer.hasExpired(100)) {
+        reportProgress();
+        reportTimer.restart();
+      }
+    }
+
+    // the queued encodes reference this frame
+    m_workerPool.clear();
+    m_workerPool.waitForDone();
+  }
+  reportProgress();
+
+  qint64 failed = m_failed.loadRelaxed();
+  qint64 written = m_done.loadRelaxed() - failed;
+  if(ok && !m_cancelled.loadRelaxed() && archive.finish() && file.commit()) {
+    qInfo("Archived %lld images to %s in %lld ms, %lld failed", written, qPrintable(m_ric.path), timer.elapsed(), failed);
+  } else {
+    if(m_cancelled.loadRelaxed()) {
+      qInfo("Rendering cancelled");
+    } else {
+      qWarning() << "Failed to write archive" << m_ric.path << file.errorString();
+    }
+    file.cancelWriting();
+    written = 0;
+  }
+
+  emit finished(written, failed);
+}
+
+void ImageExporter::run()
+{
+  if(isArchive(m_ric.path)) {
+    writeArchive();
+    return;
+  }
+
+  QElapsedTimer timer;
+  timer.start();
+
+  qint64 total = m_ric.items.size();
+  QDir dir(m_ric.path);
+  dir.mkpath(QStringLiteral("."));
+
+  bool sync = m_ric.flags & ImageDao::SYNC_EXPORT;
+  ExportManifestCommand manifestCommand {
+    QDir::cleanPath(dir.absolutePath()),
+    m_ric.size.isValid() ? m_ric.size.width() : -1,
+    m_ric.flags & ImageDao::PAD_TO_FIT,
+    {}, {}
+  };
+
+  struct ManifestRow {
+    QByteArray hash;
+    int size;
+    int flags;
+    QString filename;
+  };
+
+  QSet<qint64> selected;
+  selected.reserve(m_ric.items.size());
+  for(const RenderItem &item : m_ric.items) {
+    selected.insert(item.id);
+  }
+
+  QHash<qint64, ManifestRow> manifest;
+  QHash<qint64, QByteArray> hashes;
+  hashes.reserve(m_ric.items.size());
+  // exported earlier, deleted or purged since
+  QSet<qint64> removedImages;
+  {
+    SQLiteConnection conn = ImageDao::instance()->connPool()->open();
+    if(sync) {
+      auto ps = conn.prepare("SELECT id, hash, size, flags, filename FROM export_manifest WHERE path = ?1");
+      ps.bind(1, manifestCommand.path);
+      while(ps.step(SRC_LOCATION)) {
+        QByteArray hash = ps.resultBlobPointer(1);
+        manifest.insert(ps.resultInteger(0), { QByteArray(hash.constData(), hash.size()), (int)ps.resultInteger(2), (int)ps.resultInteger(3), ps.resultString(4) });
+      }
+
+      auto ps_deleted = conn.prepare("SELECT deleted FROM image WHERE id = ?1");
+      for(qint64 id : manifest.keys()) {
+        if(selected.contains(id))
+          continue;
+
+        ps_deleted.bind(1, id);
+        if(!ps_deleted.step(SRC_LOCATION) || ps_deleted.resultInteger(0) != 0) {
+          removedImages.insert(id);
+        }
+        ps_deleted.reset();
+      }
+    }
+
+    auto ps = conn.prepare("SELECT hash FROM store WHERE id = ?1");
+    for(const RenderItem &item : m_ric.items) {
+      ps.bind(1, item.id);
+      if(ps.step(SRC_LOCATION)) {
+        QByteArray hash = ps.resultBlobPointer(0);
+        hashes.insert(item.id, QByteArray(hash.constData(), hash.size()));
+      }
+      ps.reset();
+    }
+  }
+
+  qint64 unchanged = 0;
+  for(const RenderItem &item : m_ric.items) {
+    QString filename = fileName(item);
+    QByteArray hash = hashes.value(item.id);
+
+    auto row = manifest.constFind(item.id);
+    if(row != manifest.cend()) {
+      const ManifestRow &old = *row;
+      if(old.hash == hash && old.size == manifestCommand.size && old.flags == manifestCommand.flags &&
+         old.filename == filename && QFileInfo::exists(dir.filePath(filename))) {
+        unchanged++;
+        m_done.fetchAndAddRelaxed(1);
+        continue;
+      }
+
+      // the tags are part of the name
+      if(old.filename != filename) {
+        QFile::remove(dir.filePath(old.filename));
+      }
+    }
+
+    m_workerPool.start([this, item, hash, filename, path = dir.filePath(filename)]() {
+      if(m_cancelled.loadRelaxed())
+        return;
+
+      if(renderItem(item, path)) {
+        QMutexLocker lock(&m_writtenLock);
+        m_written.append({ item.id, hash, filename });
+      } else {
+        m_failed.fetchAndAddRelaxed(1);
+      }
+      m_done.fetchAndAddRelaxed(1);
+    });
+  }
+
+  auto reportProgress = [&]() {
+    qint64 done = m_done.loadRelaxed();
+    emit progress(done, total, done * 1000.0 / qMax<qint64>(1, timer.elapsed()));
+  };
+
+  while(!m_workerPool.waitForDone(100)) {
+    reportProgress();
+  }
+  reportProgress();
+
+  // Only files of deleted images are removed, images that are merely not
+  // part of this selection keep theirs.
+  if(sync && !m_cancelled.loadRelaxed()) {
+    for(qint64 id : removedImages) {
+      QFile::remove(dir.filePath(manifest.value(id).filename));
+      manifestCommand.removed.append(id);
+    }
+  }
+
+  manifestCommand.written = std::move(m_written);
+  if(!manifestCommand.written.isEmpty() || !manifestCommand.removed.isEmpty()) {
+    emit manifestChanged(manifestCommand);
+  }
+
+  qint64 failed = m_failed.loadRelaxed();
+  qint64 written = manifestCommand.written.size();
+  if(m_cancelled.loadRelaxed()) {
+    qInfo("Rendering cancelled");
+  }
+  qInfo("Rendered %lld images in %lld ms, %lld unchanged, %lld removed, %lld failed", written, timer.elapsed(), unchanged, (qint64)manifestCommand.removed.size(), failed);
+  emit finished(written, failed);
+}
@@ -0,0 +1,80 @@
+#ifndef IMAGEEXPORTER_H
+#define IMAGEEXPORTER_H
+
+#include <QObject>
+#include <QStringList>
+#include <QSize>
+#include <QImage>
+#include <QAtomicInt>
+#include <QThreadPool>
+#include <QMutex>
+
+class ArchiveWriter;
+struct SQLiteConnection;
+
+struct RenderItem {
+  qint64 id;
+  QString basename;
+  QString format;
+  QSize size;
+  QImage::Format pixelFormat;
+};
+
+struct ImageRenderContext {
+  QList<RenderItem> items;
+  QString path;
+  QSize size;
+  int flags;
+};
+
+struct ExportManifestEntry {
+  qint64 id;
+  QByteArray hash;
+  QString filename;
+};
+
+// Files written to and removed from an export destination, the manifest lets
+// a sync export skip images that are already up to date and find the files
+// of images that were deleted since.
+struct ExportManifestCommand {
+  QString path;
+  int size;
+  int flags;
+  QList<ExportManifestEntry> written;
+  QList<qint64> removed;
+};
+
+// Renders a selection of images to files. Every image is read with a reader
+// connection, then decoded, scaled, encoded and written on a worker pool, so
+// the writer stays free for edits while a large selection is exported.
+// A path ending in .tar or .zip is written as a single archive instead.
+class ImageExporter : public QObject {
+  Q_OBJECT
+
+  ImageRenderContext m_ric;
+  QAtomicInt m_cancelled;
+  QAtomicInteger<qint64> m_done;
+  QAtomicInteger<qint64> m_failed;
+  QThreadPool m_workerPool;
+  QMutex m_writtenLock;
+  QList<ExportManifestEntry> m_written;
+
+  QString fileName(const RenderItem &item) const;
+  QImage renderImage(const SQLiteConnection &conn, const RenderItem &item) const;
+  bool renderItem(const RenderItem &item, const QString &filename);
+  bool archiveOriginal(ArchiveWriter &archive, const SQLiteConnection &conn, const RenderItem &item, QByteArray &buffer);
+  void writeArchive();
+public:
+  explicit ImageExporter(const ImageRenderContext &ric, QObject *parent = nullptr);
+
+  // Thread safe.
+  void cancel() { m_cancelled.storeRelaxed(1); }
+public slots:
+  void run();
+signals:
+  void progress(qint64 done, qint64 total, qreal imagesPerSecond);
+  void manifestChanged(const ExportManifestCommand &command);
+  void finished(qint64 written, qint64 failed);
+};
+
+#endif // IMAGEEXPORTER_H
@@ -0,0 +1,179 @@
+#include "imageimporter.h"
+#include "imagedao.h"
+#include "archive.h"
+
+#include <QDirIterator>
+#include <QFileInfo>
+#include <QFile>
+#include <QImageReader>
+#include <QElapsedTimer>
+#include <QUrl>
+#include <QSet>
+
+ImageImporter::ImageImporter(const QStringList &paths, QObject *parent) : QObject(parent), m_paths(paths)
+{
+}
+
+static QSet<QString> imageSuffixes()
+{
+  QSet<QString> suffixes;
+  for(const QByteArray &format : QImageReader::supportedImageFormats()) {
+    suffixes.insert(QString::fromLatin1(format).toLower());
+  }
+  return suffixes;
+}
+
+static QStringList nameFilters(const QSet<QString> &suffixes)
+{
+  QStringList filters;
+  for(const QString &suffix : suffixes) {
+    filters.append(QStringLiteral("*.") + suffix);
+  }
+  filters.append(QStringLiteral("*.tar"));
+  filters.append(QStringLiteral("*.zip"));
+  return filters;
+}
+
+static std::shared_ptr<QFile> mapFile(const QString &path, QByteArray *data)
+{
+  auto file = std::make_shared<QFile>(path);
+  if(!file->open(QIODevice::ReadOnly))
+    return nullptr;
+
+  qint64 size = file->size();
+  uchar *ptr = size > 0 ? file->map(0, size) : nullptr;
+  if(ptr == nullptr)
+    return nullptr;
+
+  *data = QByteArray::fromRawData((const char *)ptr, size);
+  return file;
+}
+
+void ImageImporter::reportProgress(bool force)
+{
+  if(force || !m_progressTimer.isValid() || m_progressTimer.elapsed() > 100) {
+    m_progressTimer.start();
+    emit progress(m_done, m_total);
+  }
+}
+
+void ImageImporter::run()
+{
+  QStringList files;
+  QSet<QString> suffixes = imageSuffixes();
+  QStringList filters = nameFilters(suffixes);
+
+  for(const QString &path : m_paths) {
+    QFileInfo info(path);
+    if(info.isDir()) {
+      QDirIterator it(path, filters, QDir::Files | QDir::Readable, QDirIterator::Subdirectories | QDirIterator::FollowSymlinks);
+      while(it.hasNext()) {
+        files.append(it.next());
+      }
+    } else if(info.isFile()) {
+      files.append(info.absoluteFilePath());
+    } else {
+      qWarning() << "Import path not found" << path;
+    }
+  }
+
+  files.sort();
+  m_total = files.size();
+  qInfo() << "Importing" << m_total << "files";
+
+  QSet<QString> knownUrls;
+  {
+    SQLiteConnection conn = ImageDao::instance()->connPool()->open();
+    auto ps = conn.prepare("SELECT origin_url FROM image WHERE origin_url LIKE 'file:%'");
+    while(ps.step(SRC_LOCATION)) {
+      knownUrls.insert(ps.resultString(0));
+    }
+  }
+
+  ImageDao *dao = ImageDao::instance();
+  m_pipelineSkipped = dao->ingestSkipped();
+
+  for(const QString &path : files) {
+    if(m_cancelled.loadRelaxed())
+      break;
+
+    QUrl url = QUrl::fromLocalFile(path);
+    bool archive = isArchive(path);
+
+    if(!archive && knownUrls.contains(url.toString())) {
+      m_skipped++;
+      m_done++;
+      reportProgress();
+      continue;
+    }
+
+    QByteArray data;
+    std::shared_ptr<QFile> file = mapFile(path, &data);
+    if(!file) {
+      qWarning() << "Failed to map" << path;
+      m_failed++;
+      m_done++;
+      continue;
+    }
+
+    if(!archive) {
+      dao->ingestImage(url, data, file);
+      m_submitted++;
+      m_done++;
+      reportProgress();
+      continue;
+    }
+
+    QList<ArchiveEntry> entries = readArchiveIndex(path, (const uchar *)data.constData(), data.size());
+    m_total += entries.size();
+    for(const ArchiveEntry &entry : entries) {
+      if(m_cancelled.loadRelaxed())
+        break;
+
+      QUrl entryUrl = url;
+      entryUrl.setFragment(entry.name);
+      if(!suffixes.contains(QFileInfo(entry.name).suffix().toLower())) {
+        m_skipped++;
+      } else if(knownUrls.contains(entryUrl.toString())) {
+        m_skipped++;
+      } else if(entry.deflated) {
+        QByteArray inflated = inflateEntry((const uchar *)data.constData(), entry);
+        if(inflated.isEmpty()) {
+          m_failed++;
+        } else {
+          dao->ingestImage(entryUrl, inflated);
+          m_submitted++;
+        }
+      } else {
+        dao->ingestImage(entryUrl, QByteArray::fromRawData(data.constData() + entry.offset, entry.size), file);
+        m_submitted++;
+      }
+      m_done++;
+      reportProgress();
+    }
+    m_done++;
+  }
+
+  // Let the writer catch up, so finished() means everything is committed.
+  // Connect before checking, the pipeline may drain in between.
+  ImageIngestPipeline *pipeline = dao->ingestPipeline();
+  m_drainedConnection = connect(pipeline, &ImageIngestPipeline::drained, this, &ImageImporter::finish, Qt::QueuedConnection);
+  if(pipeline->queued() == 0)
+    finish();
+}
+
+void ImageImporter::finish()
+{
+  if(m_finished)
+    return;
+  m_finished = true;
+  disconnect(m_drainedConnection);
+
+  ImageDao *dao = ImageDao::instance();
+  m_skipped += dao->ingestSkipped() - m_pipelineSkipped;
+  m_submitted -= dao->ingestSkipped() - m_pipelineSkipped;
+
+  reportProgress(true);
+  qInfo() << "Import finished:" << m_submitted << "imported," << m_skipped << "skipped," << m_failed << "failed";
+  emit finished(m_submitted, m_skipped, m_failed);
+}
@@ -0,0 +1,42 @@
+#ifndef IMAGEIMPORTER_H
+#define IMAGEIMPORTER_H
+
+#include <QObject>
+#include <QStringList>
+#include <QAtomicInt>
+#include <QElapsedTimer>
+
+// Imports local files, recursively scanned directories and tar/zip archives.
+// Files are mapped instead of read and handed to the ingest pipeline, files
+// whose URL is already in the database are skipped without touching them.
+class ImageImporter : public QObject {
+  Q_OBJECT
+
+  QStringList m_paths;
+  QAtomicInt m_cancelled;
+
+  qint64 m_done = 0;
+  qint64 m_total = 0;
+  qint64 m_submitted = 0;
+  qint64 m_skipped = 0;
+  qint64 m_failed = 0;
+  int m_pipelineSkipped = 0;
+  bool m_finished = false;
+  QMetaObject::Connection m_drainedConnection;
+  QElapsedTimer m_progressTimer;
+
+  void reportProgress(bool force = false);
+  void finish();
+public:
+  explicit ImageImporter(const QStringList &paths, QObject *parent = nullptr);
+
+  // Thread safe.
+  void cancel() { m_cancelled.storeRelaxed(1); }
+public slots:
+  void run();
+signals:
+  void progress(qint64 done, qint64 total);
+  void finished(qint64 imported, qint64 skipped, qint64 failed);
+};
+
+#endif // IMAGEIMPORTER_H
@@ -0,0 +1,83 @@
+#include "imageingest.h"
+#include "imagedao.h"
+#include "sqlitehelper.h"
+
+ImageIngestPipeline::ImageIngestPipeline(SQLiteConnectionPool *connPool, QObject *parent) :
+  QObject(parent),
+  m_connPool(connPool),
+  m_slots(maxInFlight)
+{
+  qRegisterMetaType<IngestItem>();
+}
+
+ImageIngestPipeline::~ImageIngestPipeline()
+{
+  m_pool.waitForDone();
+}
+
+uint64_t ImageIngestPipeline::hashKey(const QByteArray &hash)
+{
+  // 64 bits of either key are plenty to tell a few million images apart.
+  uint64_t key = 0;
+  memcpy(&key, hash.constData(), qMin<qsizetype>(sizeof(key), hash.size()));
+  return key;
+}
+
+// Returns false if the hash is already known, the set is loaded from the
+// store on first use.
+bool ImageIngestPipeline::markKnown(const QByteArray &hash)
+{
+  QMutexLocker lock(&m_knownLock);
+  if(!m_knownLoaded) {
+    SQLiteConnection conn = m_connPool->open();
+    auto ps = conn.prepare("SELECT hash FROM store");
+    while(ps.step(SRC_LOCATION)) {
+      m_knownHashes.insert(hashKey(ps.resultBlobPointer(0)));
+    }
+    m_knownLoaded = true;
+    qInfo("Loaded %d known image hashes", (int)m_knownHashes.size());
+  }
+  return m_knownHashes.insert(hashKey(hash));
+}
+
+void ImageIngestPipeline::submit(const QUrl &url, const QByteArray &data, std::shared_ptr<const void> keepAlive, const QByteArray &knownHash)
+{
+  int cost = keepAlive ? 1 : heapCost;
+  m_slots.acquire(cost);
+  m_queued.fetchAndAddRelaxed(1);
+
+  m_pool.start([this, url, data, keepAlive, cost, knownHash]() {
+    // A SHA-256 computed by the caller is reused for verification.
+    QByteArray hash = knownHash.isEmpty() ? ImageDao::imageHash(data) : knownHash;
+    QByteArray sha256;
+    ImageDao::convertKey(data, &hash, &sha256);
+    if(!markKnown(hash)) {
+      qInfo() << "Skipping known image" << url.toString();
+      m_skipped.fetchAndAddRelaxed(1);
+      release(1, cost);
+      return;
+    }
+
+    // only images that are not known yet pay for the SHA-256
+    if(sha256.isEmpty()) {
+      sha256 = ImageDao::verificationHash(data, hash);
+    }
+    IngestItem item { url, data, hash, sha256, computeImageMetaData(data), keepAlive, cost };
+    emit prepared(item);
+  });
+}
+
+void ImageIngestPipeline::release(int count, int cost)
+{
+  int queued = m_queued.fetchAndAddRelaxed(-count) - count;
+  m_slots.release(cost);
+  if(queued == 0)
+    emit drained();
+}
+
+void ImageIngestPipeline::invalidateKnownHashes()
+{
+  QMutexLocker lock(&m_knownLock);
+  m_knownHashes.clear();
+  m_knownLoaded = false;
+}
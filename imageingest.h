@@ -0,0 +1,77 @@
+#ifndef IMAGEINGEST_H
+#define IMAGEINGEST_H
+
+#include "imagemetadata.h"
+#include "simpleset.h"
+
+#include <QObject>
+#include <QUrl>
+#include <QByteArray>
+#include <QThreadPool>
+#include <QSemaphore>
+#include <QAtomicInt>
+#include <QMutex>
+
+#include <memory>
+
+class SQLiteConnectionPool;
+
+struct IngestItem {
+  QUrl url;
+  QByteArray data;
+  QByteArray hash;
+  // Verification hash kept next to an XXH3-128 key.
+  QByteArray sha256;
+  ImageMetaData meta;
+  // Owner of the memory data points into, e.g. a mapped file.
+  std::shared_ptr<const void> keepAlive;
+  int cost;
+};
+
+Q_DECLARE_METATYPE(IngestItem)
+
+// First stage of image ingestion: content hashing and metadata decoding run
+// on a worker pool, the prepared items are handed to the deferred writer
+// which only performs the inserts. Images already in the store are dropped
+// right after hashing, before they are decoded.
+//
+// Items are accounted in slots, submit() blocks when all slots are taken.
+// Data that lives on the heap costs heapCost slots, mapped data is cheap
+// because the kernel can drop its pages at any time.
+class ImageIngestPipeline : public QObject {
+  Q_OBJECT
+
+  SQLiteConnectionPool *m_connPool;
+  QThreadPool m_pool;
+  QSemaphore m_slots;
+  QAtomicInt m_queued;
+  QAtomicInt m_skipped;
+
+  QMutex m_knownLock;
+  SimpleSet m_knownHashes;
+  bool m_knownLoaded = false;
+
+  bool markKnown(const QByteArray &hash);
+public:
+  static constexpr int maxInFlight = 512;
+  static constexpr int heapCost = 16;
+
+  explicit ImageIngestPipeline(SQLiteConnectionPool *connPool, QObject *parent = nullptr);
+  virtual ~ImageIngestPipeline();
+
+  void submit(const QUrl &url, const QByteArray &data, std::shared_ptr<const void> keepAlive = {}, const QByteArray &hash = QByteArray());
+  void waitForDone() { m_pool.waitForDone(); }
+  int queued() const { return m_queued.loadRelaxed(); }
+  int skipped() const { return m_skipped.loadRelaxed(); }
+
+  static uint64_t hashKey(const QByteArray &hash);
+public slots:
+  void release(int count, int cost);
+  void invalidateKnownHashes();
+signals:
+  void prepared(const IngestItem &item);
+  // Emitted from the releasing thread when the last queued item is done.
+  void drained();
+};
+
+#endif // IMAGEINGEST_H
@@ -2,6 +2,7 @@
 #include "imagedao.h"
 
 #include "sqlitehelper.h"
+#include "simpleset.h"
 
 #include "dct/fast-dct-lee.h"
 
@@ -11,7 +12,6 @@
 #include <QTextStream>
 
 #include <set>
-#include <unordered_map>
 
 uint64_t perceptualHash(const QImage &image) {
   Q_ASSERT(image.width() == 32);
@@ -181,39 +181,65 @@ QImage autoCrop(const QImage &image, int threshold) {
   return image;
 }
 
-bool updateImageMetaData(SQLiteConnection *conn, const QByteArray &imageData, quint64 imageId)
+static QImage scaledGrayscale(const QImage &image, int width, int height) {
+  QImage result = image.scaled(width, height, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+  result.convertTo(QImage::Format_Grayscale8);
+  return result;
+}
+
+ImageMetaData computeImageMetaData(const QByteArray &imageData)
 {
+  ImageMetaData meta;
+
   QBuffer buffer((QByteArray *)&imageData);
   QImageReader reader(&buffer);
 
-  QByteArray format = reader.format();
-  QSize size = reader.size();
+  meta.format = reader.format();
+  meta.size = reader.size();
+  meta.fileSize = imageData.size();
 
   reader.setBackgroundColor(Qt::darkGray);
   reader.setScaledSize({128, 128});
 
   QImage image = reader.read();
   if(image.isNull())
-    return false;
+    return meta;
 
-  auto pixelFormat = image.format();
+  meta.pixelFormat = image.format();
 
+  // All hashes share the same cropped grayscale decode.
   image.convertTo(QImage::Format_Grayscale8);
   image = autoCrop(image, 10);
-  image = image.scaled(32, 32, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
-  image.convertTo(QImage::Format_Grayscale8);
-  uint64_t phash = perceptualHash(image);
-
-  auto ps_update = conn->prepare("UPDATE image SET width = ?1, height = ?2, phash = ?3, format = ?4, filesize = ?5, pixelformat = ?6 WHERE id = ?7");
-  ps_update.bind(1, size.width());
-  ps_update.bind(2, size.height());
-  ps_update.bind(3, phash);
-  ps_update.bind(4, QString::fromLatin1(format));
-  ps_update.bind(5, imageData.size());
-  ps_update.bind(6, (qint64)pixelFormat);
-  ps_update.bind(7, imageId);
+  meta.phash = perceptualHash(scaledGrayscale(image, 32, 32));
+  meta.dhash = differenceHash(scaledGrayscale(image, 9, 8));
+  meta.bhash = blockHash(scaledGrayscale(image, 8, 8));
+  meta.valid = true;
+
+  return meta;
+}
+
+void storeImageMetaData(SQLiteConnection *conn, const ImageMetaData &meta, quint64 imageId)
+{
+  auto ps_update = conn->prepare("UPDATE image SET width = ?1, height = ?2, phash = ?3, format = ?4, filesize = ?5, pixelformat = ?6, dhash = ?7, bhash = ?8 WHERE id = ?9");
+  ps_update.bind(1, meta.size.width());
+  ps_update.bind(2, meta.size.height());
+  ps_update.bind(3, meta.phash);
+  ps_update.bind(4, QString::fromLatin1(meta.format));
+  ps_update.bind(5, meta.fileSize);
+  ps_update.bind(6, (qint64)meta.pixelFormat);
+  ps_update.bind(7, meta.dhash);
+  ps_update.bind(8, meta.bhash);
+  ps_update.bind(9, imageId);
   ps_update.exec(SRC_LOCATION);
+}
 
+bool updateImageMetaData(SQLiteConnection *conn, const QByteArray &imageData, quint64 imageId)
+{
+  ImageMetaData meta = computeImageMetaData(imageData);
+  if(!meta.valid)
+    return false;
+
+  storeImageMetaData(conn, meta, imageId);
   return true;
 }
 
@@ -254,9 +280,9 @@ static void findMatchesLinear(const std::vector<uint64_t> &hashes, std::set<uint
 }
 
 // Each hash belongs to at most one cluster.
-using HashToCluster = std::unordered_map<uint64_t, int>;
+using HashToCluster = SimpleMap<int>;
 // Each cluster consists of a number of (unique) hashes.
-using ClusterToHashList = std::unordered_map<int, std::vector<uint64_t>>;
+using ClusterToHashList = SimpleMap<std::vector<uint64_t>>;
 
 static void findClusters(const std::vector<uint64_t> &hashes, HashToCluster &hashToCluster, ClusterToHashList &clusters, int &nextClusterId, int maxd) {
   auto iter_end = hashes.end();
@@ -323,41 +349,177 @@ static void findClusters(const std::vector<uint64_t> &hashes, HashToCluster &has
   }
 }
 
-QList<QObject *> findAllDuplicates(const QList<QObject *> &irefs, int maxDistance)
+// Disjoint set over image indices, used to merge confirmed pairs into clusters.
+struct DuplicateClusters {
+  std::vector<int> parent;
+
+  DuplicateClusters(int size) : parent(size) {
+    for(int i = 0; i < size; i++) {
+      parent[i] = i;
+    }
+  }
+
+  int find(int i) {
+    while(parent[i] != i) {
+      parent[i] = parent[parent[i]];
+      i = parent[i];
+    }
+    return i;
+  }
+
+  void merge(int a, int b) {
+    parent[find(a)] = find(b);
+  }
+};
+
+// Images that haven't been rehashed since the dhash and bhash columns were
+// added only carry a perceptual hash; those are confirmed on that alone. A
+// flat image legitimately hashes to zero, so this goes by the NULL columns.
+static bool confirmDuplicate(const DuplicateCandidate &a, const DuplicateCandidate &b, int maxd) {
+  if(!a.secondaryHashes || !b.secondaryHashes) {
+    return true;
+  }
+
+  return hammingDistance(a.dhash, b.dhash) <= maxd && hammingDistance(a.bhash, b.bhash) <= maxd;
+}
+
+// Candidate pairs are found on the perceptual hash, exactly like the regular
+// search, and are only merged into a cluster once both the difference hash and
+// the block hash agree as well.
+static QList<QList<QObject *>> findDuplicateGroupsCascaded(const std::vector<DuplicateCandidate> &refs, int maxDistance)
 {
   std::vector<uint64_t> hashList;
-  std::unordered_map<uint64_t, std::vector<ImageRef *>> irefLookup;
-
-  ClusterToHashList clusterToHashList;
-  HashToCluster hashToCluster;
-  int nextClusterId = 0;
+  SimpleMap<std::vector<int>> refLookup(refs.size());
 
   QElapsedTimer timer;
   timer.start();
 
+  for(size_t i = 0; i < refs.size(); i++) {
+    uint64_t hash = refs[i].phash;
+    auto &group = refLookup[hash];
+    if(group.empty()) {
+      hashList.push_back(hash);
+    }
+    group.push_back((int)i);
+  }
+
+  DuplicateClusters clusters(refs.size());
+  int candidates = 0;
+
+  auto confirmGroups = [&](const std::vector<int> &gi, const std::vector<int> &gj, bool same) {
+    for(size_t a = 0; a < gi.size(); a++) {
+      for(size_t b = same ? a + 1 : 0; b < gj.size(); b++) {
+        candidates++;
+        if(confirmDuplicate(refs[gi[a]], refs[gj[b]], maxDistance)) {
+          clusters.merge(gi[a], gj[b]);
+        }
+      }
+    }
+  };
+
+  auto iter_end = hashList.end();
+  for(auto i = hashList.begin(); i != iter_end; ++i) {
+    const auto &gi = refLookup[*i];
+    confirmGroups(gi, gi, true);
+    for(auto j = i + 1; j != iter_end; ++j) {
+      if(hammingDistance(*i, *j) <= maxDistance) {
+        confirmGroups(gi, refLookup[*j], false);
+      }
+    }
+  }
+
+  SimpleMap<std::vector<QObject *>> clusterRefs;
+  std::vector<int> clusterOrder;
+  for(size_t i = 0; i < refs.size(); i++) {
+    int root = clusters.find(i);
+    auto &list = clusterRefs[root];
+    if(list.empty()) {
+      clusterOrder.push_back(root);
+    }
+    list.push_back(refs[i].ref);
+  }
+
+  QList<QList<QObject *>> output;
+  for(int root : clusterOrder) {
+    const auto &list = clusterRefs[root];
+    if(list.size() > 1) {
+      output.push_back(QList<QObject *>(list.begin(), list.end()));
+    }
+  }
+
+  qDebug() << __FUNCTION__ << "Time:" << timer.elapsed() << "ms Candidates:" << candidates << "Number of groups:" << output.size();
+
+  return output;
+}
+
+std::vector<DuplicateCandidate> duplicateCandidates(const QList<QObject *> &irefs)
+{
+  std::vector<DuplicateCandidate> candidates;
+  candidates.reserve(irefs.size());
   for(auto obj : irefs) {
     ImageRef *iref = qobject_cast<ImageRef *>(obj);
     if(iref != nullptr) {
-      uint64_t hash = iref->m_phash;
-
-      auto irefIter = irefLookup.find(hash);
-      if(irefIter != irefLookup.end()) {
-        // hash already exists
-        auto cIter = hashToCluster.find(hash);
-        if(cIter == hashToCluster.end()) {
-          // Hash was seen once before, but a cluster doesn't yet exist.
-          int id = nextClusterId++;
-          hashToCluster[hash] = id;
-          clusterToHashList[id].push_back(hash);
-          qDebug() << "create new cluster" << id << "for hash" << Qt::hex << hash;
-        }
+      candidates.push_back({ iref, iref->m_fileId, iref->m_phash, iref->m_dhash, iref->m_bhash, iref->m_secondaryHashes });
+    }
+  }
+  return candidates;
+}
 
-        irefIter->second.push_back(iref);
-      } else {
-        // new hash
-        hashList.push_back(hash);
-        irefLookup.emplace(hash, std::vector<ImageRef *>{ iref });
+QList<QObject *> findAllDuplicates(const QList<QObject *> &irefs, int maxDistance, bool cascaded)
+{
+  return findAllDuplicates(duplicateCandidates(irefs), maxDistance, cascaded);
+}
+
+QList<QObject *> findAllDuplicates(const std::vector<DuplicateCandidate> &candidates, int maxDistance, bool cascaded)
+{
+  QList<QObject *> output;
+  for(const auto &group : findDuplicateGroups(candidates, maxDistance, cascaded)) {
+    output.append(group);
+  }
+  return output;
+}
+
+QList<QList<QObject *>> findDuplicateGroups(const QList<QObject *> &irefs, int maxDistance, bool cascaded)
+{
+  return findDuplicateGroups(duplicateCandidates(irefs), maxDistance, cascaded);
+}
+
+QList<QList<QObject *>> findDuplicateGroups(const std::vector<DuplicateCandidate> &candidates, int maxDistance, bool cascaded)
+{
+  if(cascaded) {
+    return findDuplicateGroupsCascaded(candidates, maxDistance);
+  }
+
+  std::vector<uint64_t> hashList;
+  SimpleMap<std::vector<const DuplicateCandidate *>> irefLookup(candidates.size());
+
+  ClusterToHashList clusterToHashList;
+  HashToCluster hashToCluster;
+  int nextClusterId = 0;
+
+  QElapsedTimer timer;
+  timer.start();
+
+  for(const DuplicateCandidate &candidate : candidates) {
+    uint64_t hash = candidate.phash;
+
+    auto irefIter = irefLookup.find(hash);
+    if(irefIter != irefLookup.end()) {
+      // hash already exists
+      auto cIter = hashToCluster.find(hash);
+      if(cIter == hashToCluster.end()) {
+        // Hash was seen once before, but a cluster doesn't yet exist.
+        int id = nextClusterId++;
+        hashToCluster[hash] = id;
+        clusterToHashList[id].push_back(hash);
+        qDebug() << "create new cluster" << id << "for hash" << Qt::hex << hash;
       }
+
+      irefIter->second.push_back(&candidate);
+    } else {
+      // new hash
+      hashList.push_back(hash);
+      irefLookup.insert(hash, { &candidate });
     }
   }
 
@@ -365,24 +527,26 @@ QList<QObject *> findAllDuplicates(const QList<QObject *> &irefs, int maxDistanc
 
   findClusters(hashList, hashToCluster, clusterToHashList, nextClusterId, maxDistance);
 
-  QList<QObject *> output;
+  QList<QList<QObject *>> output;
 
   // for each cluster
   for(const auto &p : clusterToHashList) {
     qDebug() << "Cluster Id" << p.first;
+    QList<QObject *> group;
     // for each hash
     for(uint64_t h : p.second) {
       // for each iref
       qDebug() << "  Hash" << Qt::hex << h;
-      for(auto irefptr : irefLookup[h]) {
+      for(auto candidate : irefLookup[h]) {
 
-        qDebug() << "    Iref" << irefptr->m_fileId;
-        output.push_back(irefptr);
+        qDebug() << "    Iref" << candidate->id;
+        group.push_back(candidate->ref);
       }
     }
+    output.push_back(group);
   }
 
-  qDebug() <<  __FUNCTION__ << "Time:" << timer.elapsed() << "ms Number of results:" << output.size();
+  qDebug() <<  __FUNCTION__ << "Time:" << timer.elapsed() << "ms Number of groups:" << output.size();
 
   return output;
 }
@@ -5,12 +5,44 @@
 #include <QRunnable>
 #include <QImage>
 #include <QByteArray>
+#include <QSize>
 
-QList<QObject *> findAllDuplicates(const QList<QObject *> &irefs, int maxDistance);
+#include <vector>
+
+struct ImageMetaData {
+  QByteArray format;
+  QSize size;
+  QImage::Format pixelFormat = QImage::Format_Invalid;
+  qint64 fileSize = 0;
+  uint64_t phash = 0;
+  uint64_t dhash = 0;
+  uint64_t bhash = 0;
+  bool valid = false;
+};
+
+// The hashes of an image, copied from its ImageRef on the thread that owns it
+// so the duplicate search can run elsewhere. The ref is carried along for the
+// result but never dereferenced.
+struct DuplicateCandidate {
+  QObject *ref;
+  qint64 id;
+  uint64_t phash;
+  uint64_t dhash;
+  uint64_t bhash;
+  bool secondaryHashes;
+};
+
+std::vector<DuplicateCandidate> duplicateCandidates(const QList<QObject *> &irefs);
+QList<QObject *> findAllDuplicates(const QList<QObject *> &irefs, int maxDistance, bool cascaded = false);
+QList<QObject *> findAllDuplicates(const std::vector<DuplicateCandidate> &candidates, int maxDistance, bool cascaded = false);
+QList<QList<QObject *>> findDuplicateGroups(const QList<QObject *> &irefs, int maxDistance, bool cascaded = false);
+QList<QList<QObject *>> findDuplicateGroups(const std::vector<DuplicateCandidate> &candidates, int maxDistance, bool cascaded = false);
 uint64_t perceptualHash(const QImage &image);
 uint64_t blockHash(const QImage &image);
 uint64_t differenceHash(const QImage &image);
 QImage autoCrop(const QImage &image, int threshold);
+ImageMetaData computeImageMetaData(const QByteArray &data);
+void storeImageMetaData(struct SQLiteConnection *conn, const ImageMetaData &meta, quint64 id);
 bool updateImageMetaData(struct SQLiteConnection *m_conn, const QByteArray &data, quint64 id);
 
 #endif // IMAGEMETADATA_H
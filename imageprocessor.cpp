@@ -20,20 +20,30 @@ ImageProcessor::ImageProcessor(QObject *parent) : QObject(parent)
   connect(&m_downloadThread, &QThread::finished, fetcher, &QObject::deleteLater);
 
   connect(this, &ImageProcessor::startDownload, fetcher, &ImageFetcher::startDownload);
-  connect(fetcher, &ImageFetcher::downloadComplete, ImageDao::instance(), &ImageDao::deferredWriteImage);
+  // Direct, so a full ingest pipeline stalls the download thread.
+  connect(fetcher, &ImageFetcher::downloadComplete, ImageDao::instance(), &ImageDao::ingestImage, Qt::DirectConnection);
+  connect(fetcher, &ImageFetcher::statsChanged, this, &ImageProcessor::setDownloadStats);
   connect(ImageDao::instance(), &ImageDao::writeComplete, this, &ImageProcessor::imageReady);
+  connect(ImageDao::instance(), &ImageDao::aboutToShutDown, this, &ImageProcessor::stopDownloads, Qt::DirectConnection);
 
   m_downloadThread.start();
 }
 
 ImageProcessor::~ImageProcessor()
 {
-  m_downloadThread.quit();
-  m_downloadThread.wait();
+  stopDownloads();
 
   qInfo(__FUNCTION__);
 }
 
+void ImageProcessor::stopDownloads()
+{
+  // A fetcher blocked in ImageDao::ingestImage returns once the writer has
+  // committed enough to free a slot, so this must run before the writer stops.
+  m_downloadThread.quit();
+  m_downloadThread.wait();
+}
+
 void ImageProcessor::setClipBoard(const QString &data) {
   QClipboard *cb = QGuiApplication::clipboard();
   cb->setText(data);
@@ -62,8 +72,18 @@ void ImageProcessor::downloadText(const QString &str) {
 
 void ImageProcessor::downloadList(const QList<QUrl> &urls)
 {
+  // Local files and directories go through the bulk importer.
+  QStringList paths;
   for(const auto &url : urls) {
-    emit startDownload(url);
+    if(url.isLocalFile()) {
+      paths.append(url.toLocalFile());
+    } else {
+      emit startDownload(url);
+    }
+  }
+
+  if(!paths.isEmpty()) {
+    ImageDao::instance()->importPaths(paths);
   }
 }
 
@@ -93,6 +113,17 @@ QList<QUrl> ImageProcessor::parseTextUriList(const QString &text)
   return result;
 }
 
+void ImageProcessor::setDownloadStats(int queued, int active, int completed, int failed, int known, qint64 bytesInFlight)
+{
+  m_downloadsQueued = queued;
+  m_downloadsActive = active;
+  m_downloadsCompleted = completed;
+  m_downloadsFailed = failed;
+  m_downloadsKnown = known;
+  m_downloadBytesInFlight = bytesInFlight;
+  emit downloadStatsChanged();
+}
+
 bool ImageFetcher::isHttpRedirect(QNetworkReply *reply)
 {
   int statusCode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
@@ -100,41 +131,228 @@ bool ImageFetcher::isHttpRedirect(QNetworkReply *reply)
       || statusCode == 305 || statusCode == 307 || statusCode == 308;
 }
 
-ImageFetcher::ImageFetcher(QObject *parent) : QObject(parent), manager(this)
+ImageFetcher::ImageFetcher(QObject *parent) :
+  QObject(parent),
+  manager(this)
 {
   connect(&manager, SIGNAL(finished(QNetworkReply*)),
           SLOT(downloadFinished(QNetworkReply*)));
 }
 
+bool ImageFetcher::isTransientError(QNetworkReply *reply)
+{
+  int statusCode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+  if(statusCode == 429 || statusCode >= 500)
+    return true;
+
+  switch(reply->error()) {
+  case QNetworkReply::ConnectionRefusedError:
+  case QNetworkReply::RemoteHostClosedError:
+  case QNetworkReply::TimeoutError:
+  case QNetworkReply::TemporaryNetworkFailureError:
+  case QNetworkReply::NetworkSessionFailedError:
+  case QNetworkReply::ProxyTimeoutError:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Borrows a connection per check, a long-lived one would hold up
+// SQLiteConnectionPool::replaceDatabase().
+bool ImageFetcher::isKnownUrl(const QUrl &url)
+{
+  SQLiteConnection conn = ImageDao::instance()->connPool()->open();
+  auto ps = conn.prepare("SELECT id FROM image WHERE origin_url = ?1 LIMIT 1");
+  ps.bind(1, url.toString());
+  return ps.step(SRC_LOCATION);
+}
+
 void ImageFetcher::startDownload(const QUrl &url)
 {
-  QNetworkRequest req(url);
+  if(isKnownUrl(url)) {
+    qInfo() << "Skipping download of known URL" << url.toString();
+    m_known++;
+    emitStats();
+    return;
+  }
+
+  enqueue({ url, url, 0, nullptr });
+  schedule();
+}
+
+void ImageFetcher::enqueue(const DownloadJob &job)
+{
+  QString host = job.url.host();
+  auto &queue = m_hostQueues[host];
+  if(queue.isEmpty()) {
+    m_hosts.enqueue(host);
+  }
+  queue.enqueue(job);
+  m_queued++;
+}
+
+void ImageFetcher::start(const DownloadJob &job)
+{
+  QNetworkRequest req(job.url);
+  req.setTransferTimeout(30000);
   QNetworkReply *reply = manager.get(req);
+  m_replies.insert(reply, { job.url, job.origin, job.attempt, std::make_shared<DownloadSpool>() });
+  m_hostActive[job.url.host()]++;
+
+  connect(reply, &QNetworkReply::readyRead, this, [this, reply]() { consume(reply); });
 
 #if QT_CONFIG(ssl)
   connect(reply, SIGNAL(sslErrors(QList<QSslError>)),
           SLOT(sslErrors(QList<QSslError>)));
 #endif
+}
+
+// Moves available response data into the spool. Only bodies held in memory
+// count towards the reported bytes in flight.
+void ImageFetcher::consume(QNetworkReply *reply)
+{
+  auto it = m_replies.find(reply);
+  if(it == m_replies.end())
+    return;
 
+  DownloadSpool *spool = it->spool.get();
+  QByteArray chunk = reply->readAll();
+  if(chunk.isEmpty() || spool->failed)
+    return;
+
+  spool->hash.addData(chunk);
+
+  if(!spool->file && spool->buffer.size() + chunk.size() > spoolThreshold) {
+    auto file = std::make_shared<QTemporaryFile>();
+    if(file->open() && file->write(spool->buffer) == spool->buffer.size()) {
+      m_bytesInFlight -= spool->buffer.size();
+      spool->buffer.clear();
+      spool->file = file;
+    } else {
+      qWarning() << "Failed to spool download to" << file->fileName();
+    }
+  }
+
+  if(spool->file) {
+    if(spool->file->write(chunk) != chunk.size()) {
+      qWarning() << "Failed to write spool file" << spool->file->fileName() << spool->file->errorString();
+      spool->failed = true;
+    }
+  } else {
+    spool->buffer.append(chunk);
+    m_bytesInFlight += chunk.size();
+  }
+}
+
+// Returns the complete body, either the in-memory buffer or a mapping of the
+// spool file which stays valid as long as keepAlive.
+bool ImageFetcher::finishSpool(DownloadSpool *spool, QByteArray *data, std::shared_ptr<const void> *keepAlive)
+{
+  m_bytesInFlight -= spool->buffer.size();
+
+  if(spool->failed)
+    return false;
+
+  if(!spool->file) {
+    *data = spool->buffer;
+    return true;
+  }
+
+  QTemporaryFile *file = spool->file.get();
+  uchar *ptr = file->flush() && file->size() > 0 ? file->map(0, file->size()) : nullptr;
+  if(ptr == nullptr) {
+    qWarning() << "Failed to map spool file" << file->fileName();
+    return false;
+  }
+
+  *data = QByteArray::fromRawData((const char *)ptr, file->size());
+  *keepAlive = spool->file;
+  return true;
+}
+
+// Hosts take turns, a host at its limit is rotated to the back. Stops when
+// every remaining host is at its limit or a global limit is reached.
+void ImageFetcher::schedule()
+{
+  int blocked = 0;
+  while(blocked < m_hosts.size() && m_replies.size() < maxActive) {
+    QString host = m_hosts.dequeue();
+    if(m_hostActive.value(host) >= maxActivePerHost) {
+      m_hosts.enqueue(host);
+      blocked++;
+      continue;
+    }
+
+    blocked = 0;
+    auto &queue = m_hostQueues[host];
+    DownloadJob job = queue.dequeue();
+    if(queue.isEmpty()) {
+      m_hostQueues.remove(host);
+    } else {
+      m_hosts.enqueue(host);
+    }
+    m_queued--;
+    start(job);
+  }
+
+  emitStats();
+}
+
+void ImageFetcher::emitStats()
+{
+  emit statsChanged(m_queued + m_retrying, m_replies.size(), m_completed, m_failed, m_known, m_bytesInFlight);
 }
 
 void ImageFetcher::downloadFinished(QNetworkReply *reply)
 {
+  consume(reply);
+
+  DownloadJob job = m_replies.take(reply);
+  QByteArray data;
+  std::shared_ptr<const void> keepAlive;
+  bool complete = job.spool && finishSpool(job.spool.get(), &data, &keepAlive);
+  QString host = job.url.host();
+  if(--m_hostActive[host] == 0) {
+    m_hostActive.remove(host);
+  }
+
   QUrl url = reply->url();
   if (reply->error()) {
-    qWarning("Download of %s failed: %s",
-             url.toEncoded().constData(),
-             qPrintable(reply->errorString()));
+    if(isTransientError(reply) && job.attempt + 1 < maxAttempts) {
+      int delay = 1000 << job.attempt;
+      qWarning("Download of %s failed, retrying in %d ms: %s",
+               url.toEncoded().constData(), delay,
+               qPrintable(reply->errorString()));
+      m_retrying++;
+      QTimer::singleShot(delay, this, [this, url = job.url, origin = job.origin, attempt = job.attempt]() {
+        m_retrying--;
+        enqueue({ url, origin, attempt + 1, nullptr });
+        schedule();
+      });
+    } else {
+      qWarning("Download of %s failed: %s",
+               url.toEncoded().constData(),
+               qPrintable(reply->errorString()));
+      m_failed++;
+    }
+  } else if(!complete) {
+    m_failed++;
   } else {
     if (isHttpRedirect(reply)) {
       QUrl newLocation = reply->header(QNetworkRequest::LocationHeader).toUrl();
       qDebug() << "Request was redirected. Location:" << newLocation;
-      emit startDownload(newLocation);
+      enqueue({ url.resolved(newLocation), job.origin, job.attempt, nullptr });
     } else {
-      QByteArray bytes = reply->readAll();
-      emit downloadComplete(url, bytes);
+      // Stored under the requested URL rather than the final one after
+      // redirects, so the known URL check matches the next time around.
+      // Blocks while the ingest pipeline is full, which holds back new
+      // requests as well.
+      emit downloadComplete(job.origin, data, keepAlive, job.spool->hash.result());
+      m_completed++;
     }
   }
 
   reply->deleteLater();
+  schedule();
 }
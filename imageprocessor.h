@@ -7,13 +7,67 @@
 #include <QQueue>
 #include <QThread>
 #include <QTimer>
+#include <QHash>
+#include <QCryptographicHash>
+#include <QTemporaryFile>
 
+#include <memory>
+
+#include "sqlitehelper.h"
+
+// Response body of a download in progress. The content hash is updated as
+// data arrives, bodies larger than spoolThreshold move to a temporary file
+// which is mapped once the download completes.
+struct DownloadSpool {
+  QCryptographicHash hash { QCryptographicHash::Sha256 };
+  QByteArray buffer;
+  std::shared_ptr<QTemporaryFile> file;
+  // Set when writing the spool file failed, the rest of the body is dropped.
+  bool failed = false;
+};
+
+struct DownloadJob {
+  QUrl url;
+  QUrl origin;
+  int attempt;
+  std::shared_ptr<DownloadSpool> spool;
+};
+
+// Downloads are queued per host and started round robin, limited by the
+// number of concurrent requests (in total and per host). Memory is bounded by
+// the spool threshold per request and by the ingest pipeline, which blocks
+// downloadComplete while it is full. Transient failures are retried with
+// exponential backoff.
 class ImageFetcher : public QObject {
   Q_OBJECT
 
   QNetworkAccessManager manager;
+  QHash<QString, QQueue<DownloadJob>> m_hostQueues;
+  QQueue<QString> m_hosts;
+  QHash<QString, int> m_hostActive;
+  QHash<QNetworkReply *, DownloadJob> m_replies;
+  qint64 m_bytesInFlight = 0;
+  int m_queued = 0;
+  int m_retrying = 0;
+  int m_completed = 0;
+  int m_failed = 0;
+  int m_known = 0;
+
+  bool isKnownUrl(const QUrl &url);
   bool isHttpRedirect(QNetworkReply *reply);
+  bool isTransientError(QNetworkReply *reply);
+  void consume(QNetworkReply *reply);
+  bool finishSpool(DownloadSpool *spool, QByteArray *data, std::shared_ptr<const void> *keepAlive);
+  void enqueue(const DownloadJob &job);
+  void start(const DownloadJob &job);
+  void schedule();
+  void emitStats();
 public:
+  static constexpr int maxActive = 8;
+  static constexpr int maxActivePerHost = 2;
+  static constexpr int maxAttempts = 4;
+  static constexpr qint64 spoolThreshold = 1024 * 1024;
+
   ImageFetcher(QObject *parent = nullptr);
 public slots:
   void startDownload(const QUrl &url);
@@ -21,14 +75,27 @@ private slots:
   void downloadFinished(QNetworkReply *reply);
   void sslErrors(const QList<QSslError> &sslErrors);
 signals:
-  void downloadComplete(const QUrl &url, const QByteArray &data);
+  void downloadComplete(const QUrl &url, const QByteArray &data, std::shared_ptr<const void> keepAlive, const QByteArray &hash);
+  void statsChanged(int queued, int active, int completed, int failed, int known, qint64 bytesInFlight);
 };
 
 class ImageProcessor : public QObject
 {
   Q_OBJECT
+  Q_PROPERTY(int downloadsQueued READ downloadsQueued NOTIFY downloadStatsChanged)
+  Q_PROPERTY(int downloadsActive READ downloadsActive NOTIFY downloadStatsChanged)
+  Q_PROPERTY(int downloadsCompleted READ downloadsCompleted NOTIFY downloadStatsChanged)
+  Q_PROPERTY(int downloadsFailed READ downloadsFailed NOTIFY downloadStatsChanged)
+  Q_PROPERTY(int downloadsKnown READ downloadsKnown NOTIFY downloadStatsChanged)
+  Q_PROPERTY(qint64 downloadBytesInFlight READ downloadBytesInFlight NOTIFY downloadStatsChanged)
 
   QThread m_downloadThread;
+  int m_downloadsQueued = 0;
+  int m_downloadsActive = 0;
+  int m_downloadsCompleted = 0;
+  int m_downloadsFailed = 0;
+  int m_downloadsKnown = 0;
+  qint64 m_downloadBytesInFlight = 0;
 public:
   explicit ImageProcessor(QObject *parent = nullptr);
   virtual ~ImageProcessor();
@@ -40,9 +107,21 @@ public:
   Q_INVOKABLE QString urlFileName(const QUrl &url);
   Q_INVOKABLE bool isUrl(const QString &text);
   Q_INVOKABLE QList<QUrl> parseTextUriList(const QString &text);
+
+  int downloadsQueued() const { return m_downloadsQueued; }
+  int downloadsActive() const { return m_downloadsActive; }
+  int downloadsCompleted() const { return m_downloadsCompleted; }
+  int downloadsFailed() const { return m_downloadsFailed; }
+  int downloadsKnown() const { return m_downloadsKnown; }
+  qint64 downloadBytesInFlight() const { return m_downloadBytesInFlight; }
+public slots:
+  void stopDownloads();
+private slots:
+  void setDownloadStats(int queued, int active, int completed, int failed, int known, qint64 bytesInFlight);
 signals:
   void imageReady(const QUrl &url, quint64 fileId);
   void startDownload(const QUrl &url);
+  void downloadStatsChanged();
 };
 
 #endif // IMAGEPROCESSOR_H
@@ -32,6 +32,10 @@ public:
   QString m_overlayFormat;
   qint64 m_fileId = 0;
   qint64 m_phash = 0;
+  qint64 m_dhash = 0;
+  qint64 m_bhash = 0;
+  // dhash and bhash are NULL until the image is (re)hashed.
+  bool m_secondaryHashes = false;
   qint64 m_fileSize = 0;
   QImage::Format m_pixelFormat = QImage::Format_Invalid;
 
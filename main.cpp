@@ -1,3 +1,4 @@
+#include "batchmode.h"
 #include "fileutils.h"
 #include "imagedao.h"
 #include "imageprocessor.h"
@@ -49,6 +50,13 @@ static void installFileLogging(const QString &logfile) {
 
 int main(int argc, char *argv[])
 {
+  if(argc >= 2 && qstrcmp(argv[1], "--batch") == 0) {
+    if(argc >= 3) {
+      installFileLogging(QFileInfo(QString::fromLocal8Bit(argv[2])).absoluteFilePath() + ".batch.log");
+    }
+    return runBatch(argc, argv);
+  }
+
   Thumper thumper;
 
   QApplication app(argc, argv);
@@ -33,7 +33,10 @@ ApplicationWindow {
     'cellFillMode',
     'renderPadToFit',
     'renderFilenameToClipboard',
+    'renderSync',
     'duplicateSearchDistance',
+    'duplicateSearchCascaded',
+    'similarSearchDistance',
     'showHiddenImages',
     'spacing',
     'zoomOnHover',
@@ -60,8 +63,10 @@ ApplicationWindow {
 
   Component.onCompleted: {    
     loadSettings()
-    allSimpleList = ImageDao.all(showHiddenImages)
-    setViewList(allSimpleList)
+    ImageDao.allAsync(showHiddenImages, function(refList) {
+      allSimpleList = refList
+      setViewList(allSimpleList)
+    })
   }
 
   Component.onDestruction: {
@@ -92,8 +97,11 @@ ApplicationWindow {
   property bool autoTagging: false
   property bool renderPadToFit: false
   property bool renderFilenameToClipboard: false
+  property bool renderSync: false
   property bool gridShowImageIds: false
   property int duplicateSearchDistance: 4
+  property bool duplicateSearchCascaded: false
+  property int similarSearchDistance: 12
   property bool showHiddenImages: false
   property bool zoomOnHover: true
   property string imageOverlayFormat: "$id$\n$width$x$height$ $size$KB $format$\n$tags$"
@@ -201,7 +209,7 @@ ApplicationWindow {
   function actionDelete(refList, record = true) {
     var actionList = []
 
-    actionList = ImageDao.updateDeleted(refList, true);
+    actionList = ImageDao.setDeleted(refList, true);
     console.log("Deleted", actionList.length, "image(s)")
 
     if(record && actionList.length > 0) {
@@ -212,7 +220,7 @@ ApplicationWindow {
   function actionUndelete(refList, record = true) {
     var actionList = []
 
-    actionList = ImageDao.updateDeleted(refList, false);
+    actionList = ImageDao.setDeleted(refList, false);
     console.log("Undeleted", actionList.length, "image(s)")
 
     if(record && actionList.length > 0) {
@@ -228,6 +236,9 @@ ApplicationWindow {
     if(renderFilenameToClipboard)
       flags |= ImageDao.FNAME_TO_CLIPBOARD
 
+    if(renderSync)
+      flags |= ImageDao.SYNC_EXPORT
+
     ImageDao.renderImages(effectiveSelectionModel, thumper.resolveRelativePath(pathPrefix), renderSize, flags)
   }
 
@@ -248,9 +259,7 @@ ApplicationWindow {
         var foundTags = basename.match(word)
 
         console.log("Tags found", foundTags)        
-        for(var i in foundTags) {
-          ImageDao.addTag([ref], foundTags[i])
-        }
+        ImageDao.addTags([ref], foundTags)
       }
 
       allSimpleList.push(ref)
@@ -447,6 +456,12 @@ ApplicationWindow {
       } else if(event.key === Qt.Key_R) {
         renderImages()
         event.accepted = true
+      } else if(event.key === Qt.Key_S) {
+        var ref = viewModelSimpleList[currentIndex]
+        if(ref) {
+          setViewList([ ref ].concat(ImageDao.findSimilar(ref.fileId, 200, similarSearchDistance)))
+        }
+        event.accepted = true
       } else if(event.key === Qt.Key_Delete) {
         actionDelete(effectiveSelectionModel)
         event.accepted = true
@@ -717,6 +732,33 @@ ApplicationWindow {
         }
       }
 
+      Label {
+        visible: processor.downloadsActive + processor.downloadsQueued > 0
+        text: "Downloading %1 (%2 queued, %3 failed, %4 already known)".arg(processor.downloadsActive).arg(processor.downloadsQueued).arg(processor.downloadsFailed).arg(processor.downloadsKnown)
+      }
+
+      Label {
+        visible: ImageDao.ingestQueued > 0
+        text: "Importing %1 (%2 images/s)".arg(ImageDao.ingestQueued).arg(ImageDao.ingestRate.toFixed(1))
+      }
+
+      Label {
+        visible: ImageDao.taskName !== ""
+        text: ImageDao.taskEta >= 0 ? "%1 (%2 s left)".arg(ImageDao.taskPhase).arg(Math.ceil(ImageDao.taskEta / 1000)) : ImageDao.taskPhase
+      }
+
+      ProgressBar {
+        visible: ImageDao.progress >= 0 || ImageDao.taskName !== ""
+        indeterminate: ImageDao.progress < 0
+        value: ImageDao.progress
+      }
+
+      ToolButton {
+        visible: ImageDao.progress >= 0 || ImageDao.taskName !== ""
+        text: "Cancel"
+        onClicked: ImageDao.cancelBackgroundTask()
+      }
+
       BusyIndicator {
         parent: Overlay.overlay
         anchors.centerIn: parent
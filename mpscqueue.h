@@ -0,0 +1,63 @@
+#ifndef MPSCQUEUE_H
+#define MPSCQUEUE_H
+
+#include <atomic>
+#include <utility>
+
+// Unbounded lock-free queue for many producers and a single consumer
+// (Vyukov's intrusive MPSC design). push() is wait-free. pop() may report
+// an empty queue while a concurrent push() is halfway done, the producer is
+// expected to wake the consumer after pushing.
+template <typename T>
+class MpscQueue {
+  struct Node {
+    std::atomic<Node *> next { nullptr };
+    T value;
+  };
+
+  std::atomic<Node *> m_head;
+  Node *m_tail;
+public:
+  MpscQueue() {
+    Node *stub = new Node();
+    m_head.store(stub);
+    m_tail = stub;
+  }
+
+  MpscQueue(const MpscQueue &) = delete;
+  MpscQueue &operator =(const MpscQueue &) = delete;
+
+  ~MpscQueue() {
+    while(m_tail != nullptr) {
+      Node *next = m_tail->next.load();
+      delete m_tail;
+      m_tail = next;
+    }
+  }
+
+  void push(T value) {
+    Node *node = new Node();
+    node->value = std::move(value);
+    Node *prev = m_head.exchange(node);
+    prev->next.store(node);
+  }
+
+  // Consumer only.
+  bool pop(T &value) {
+    Node *next = m_tail->next.load();
+    if(next == nullptr)
+      return false;
+
+    value = std::move(next->value);
+    delete m_tail;
+    m_tail = next;
+    return true;
+  }
+
+  // Consumer only.
+  bool empty() const {
+    return m_tail->next.load() == nullptr;
+  }
+};
+
+#endif // MPSCQUEUE_H
@@ -0,0 +1,197 @@
+#include "phashindex.h"
+
+#include <algorithm>
+
+int PHashIndex::distance(uint64_t a, uint64_t b)
+{
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_popcountll(a ^ b);
+#else
+  uint64_t x = a ^ b;
+  x -= (x >> 1) & 0x5555555555555555;
+  x = (x & 0x3333333333333333) + ((x >> 2) & 0x3333333333333333);
+  x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0f;
+  return (x * 0x0101010101010101) >> 56;
+#endif
+}
+
+void PHashIndex::clear()
+{
+  m_ids.clear();
+  m_hashes.clear();
+  m_dead.clear();
+  m_deadCount = 0;
+  m_pendingIds.clear();
+  m_pendingHashes.clear();
+  for(int b = 0; b < bandCount; b++) {
+    m_offsets[b].clear();
+    m_postings[b].clear();
+  }
+}
+
+void PHashIndex::insert(int64_t id, uint64_t hash)
+{
+  m_pendingIds.push_back(id);
+  m_pendingHashes.push_back(hash);
+
+  if(m_pendingIds.size() >= maxPending) {
+    build();
+  }
+}
+
+// Meant for batches, every call scans all ids once. The buckets are rebuilt
+// when an eighth of the built part is dead.
+void PHashIndex::remove(std::vector<int64_t> ids)
+{
+  if(ids.empty())
+    return;
+  std::sort(ids.begin(), ids.end());
+  auto removed = [&ids](int64_t id) { return std::binary_search(ids.begin(), ids.end(), id); };
+
+  size_t kept = 0;
+  for(size_t i = 0; i < m_pendingIds.size(); i++) {
+    if(!removed(m_pendingIds[i])) {
+      m_pendingIds[kept] = m_pendingIds[i];
+      m_pendingHashes[kept] = m_pendingHashes[i];
+      kept++;
+    }
+  }
+  m_pendingIds.resize(kept);
+  m_pendingHashes.resize(kept);
+
+  for(size_t i = 0; i < m_ids.size(); i++) {
+    if(!m_dead[i] && removed(m_ids[i])) {
+      m_dead[i] = 1;
+      m_deadCount++;
+    }
+  }
+
+  if(m_deadCount > m_ids.size() / 8) {
+    build();
+  }
+}
+
+void PHashIndex::build()
+{
+  if(m_deadCount > 0) {
+    size_t kept = 0;
+    for(size_t i = 0; i < m_ids.size(); i++) {
+      if(!m_dead[i]) {
+        m_ids[kept] = m_ids[i];
+        m_hashes[kept] = m_hashes[i];
+        kept++;
+      }
+    }
+    m_ids.resize(kept);
+    m_hashes.resize(kept);
+    m_deadCount = 0;
+  }
+
+  m_ids.insert(m_ids.end(), m_pendingIds.begin(), m_pendingIds.end());
+  m_hashes.insert(m_hashes.end(), m_pendingHashes.begin(), m_pendingHashes.end());
+  m_pendingIds.clear();
+  m_pendingHashes.clear();
+  m_dead.assign(m_ids.size(), 0);
+
+  const uint32_t buckets = 1 << bandBits;
+
+  for(int b = 0; b < bandCount; b++) {
+    auto &offsets = m_offsets[b];
+    auto &postings = m_postings[b];
+
+    offsets.assign(buckets + 1, 0);
+    for(uint64_t h : m_hashes) {
+      offsets[band(h, b) + 1]++;
+    }
+    for(uint32_t i = 0; i < buckets; i++) {
+      offsets[i + 1] += offsets[i];
+    }
+
+    std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+    postings.resize(m_hashes.size());
+    for(uint32_t i = 0; i < m_hashes.size(); i++) {
+      postings[fill[band(m_hashes[i], b)]++] = i;
+    }
+  }
+}
+
+void PHashIndex::scanLinear(const std::vector<int64_t> &ids, const std::vector<uint64_t> &hashes, const uint8_t *dead, uint64_t hash, int maxDistance, std::vector<Match> &out) const
+{
+  for(size_t i = 0; i < hashes.size(); i++) {
+    if(dead != nullptr && dead[i])
+      continue;
+    int d = distance(hashes[i], hash);
+    if(d <= maxDistance) {
+      out.push_back({ ids[i], hashes[i], d });
+    }
+  }
+}
+
+std::vector<PHashIndex::Match> PHashIndex::query(uint64_t hash, int k, int maxDistance) const
+{
+  std::vector<Match> out;
+
+  int radius = maxDistance / bandCount;
+  if(radius > maxBandRadius || m_offsets[0].empty()) {
+    // Probing the neighbourhood would touch most buckets anyway.
+    scanLinear(m_ids, m_hashes, m_dead.data(), hash, maxDistance, out);
+  } else {
+    uint32_t queryBands[bandCount];
+    for(int b = 0; b < bandCount; b++) {
+      queryBands[b] = band(hash, b);
+    }
+
+    auto probe = [&](int b, uint32_t key) {
+      const auto &offsets = m_offsets[b];
+      const auto &postings = m_postings[b];
+      for(uint32_t p = offsets[key]; p < offsets[key + 1]; p++) {
+        uint32_t i = postings[p];
+        if(m_dead[i])
+          continue;
+        uint64_t h = m_hashes[i];
+
+        // Report each hash only from the first band it matches on.
+        bool seen = false;
+        for(int pb = 0; pb < b && !seen; pb++) {
+          seen = distance(band(h, pb), queryBands[pb]) <= radius;
+        }
+
+        int d = distance(h, hash);
+        if(!seen && d <= maxDistance) {
+          out.push_back({ m_ids[i], h, d });
+        }
+      }
+    };
+
+    for(int b = 0; b < bandCount; b++) {
+      uint32_t key = queryBands[b];
+      probe(b, key);
+      for(int i = 0; i < bandBits && radius >= 1; i++) {
+        uint32_t ki = key ^ (1u << i);
+        probe(b, ki);
+        for(int j = i + 1; j < bandBits && radius >= 2; j++) {
+          uint32_t kj = ki ^ (1u << j);
+          probe(b, kj);
+          for(int l = j + 1; l < bandBits && radius >= 3; l++) {
+            probe(b, kj ^ (1u << l));
+          }
+        }
+      }
+    }
+  }
+
+  scanLinear(m_pendingIds, m_pendingHashes, nullptr, hash, maxDistance, out);
+
+  auto byDistance = [](const Match &a, const Match &b) {
+    return a.distance < b.distance || (a.distance == b.distance && a.id < b.id);
+  };
+
+  if(k >= 0 && out.size() > (size_t)k) {
+    std::partial_sort(out.begin(), out.begin() + k, out.end(), byDistance);
+    out.resize(k);
+  } else {
+    std::sort(out.begin(), out.end(), byDistance);
+  }
+
+  return out;
+}
@@ -0,0 +1,54 @@
+#ifndef PHASHINDEX_H
+#define PHASHINDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Hamming space index over 64 bit perceptual hashes.
+//
+// The hash is split into four 16 bit bands. Two hashes within distance d agree
+// within d / 4 bits on at least one band, so a query only has to probe the
+// bucket neighbourhood of each band instead of every hash in the library.
+class PHashIndex {
+public:
+  struct Match {
+    int64_t id;
+    uint64_t hash;
+    int distance;
+  };
+
+  void clear();
+  void insert(int64_t id, uint64_t hash);
+  void remove(std::vector<int64_t> ids);
+  void build();
+
+  std::vector<Match> query(uint64_t hash, int k, int maxDistance) const;
+  size_t size() const { return m_ids.size() - m_deadCount + m_pendingIds.size(); }
+
+  static int distance(uint64_t a, uint64_t b);
+private:
+  static constexpr int bandCount = 4;
+  static constexpr int bandBits = 16;
+  static constexpr int maxBandRadius = 3;
+  static constexpr size_t maxPending = 4096;
+
+  static uint32_t band(uint64_t hash, int b) { return (hash >> (b * bandBits)) & 0xFFFF; }
+
+  void scanLinear(const std::vector<int64_t> &ids, const std::vector<uint64_t> &hashes, const uint8_t *dead, uint64_t hash, int maxDistance, std::vector<Match> &out) const;
+
+  // Built part, bucketed per band (CSR layout). Removed entries are only
+  // flagged dead until the next build.
+  std::vector<int64_t> m_ids;
+  std::vector<uint64_t> m_hashes;
+  std::vector<uint8_t> m_dead;
+  size_t m_deadCount = 0;
+  std::vector<uint32_t> m_offsets[bandCount];
+  std::vector<uint32_t> m_postings[bandCount];
+
+  // Inserted after the last build, scanned linearly.
+  std::vector<int64_t> m_pendingIds;
+  std::vector<uint64_t> m_pendingHashes;
+};
+
+#endif // PHASHINDEX_H
@@ -1,100 +1,383 @@
 #ifndef SIMPLESET_H
 #define SIMPLESET_H
 
+#include <cstddef>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <utility>
 #include <vector>
 
-struct SimpleSet {
-  struct Bucket {
-    int size;
-    int count;
-    uint64_t data[];
-  };
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SIMPLESET_SSE2
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Open addressing hash set and map for 64 bit keys.
+//
+// Slots are organised in groups of 16 with one control byte per slot. A full
+// slot stores 7 bits of the key hash in its control byte, so a lookup compares
+// a whole group with a single SSE2 compare and only touches slots whose
+// control byte matches. Probing moves between groups (triangular sequence)
+// and stops at the first group that still has an empty slot.
+namespace simpleset_detail {
+
+enum : int8_t {
+  Empty = -128,
+  Deleted = -2,
+};
+
+constexpr size_t GroupSize = 16;
 
-  Bucket **buckets;
-  int bucketCountBits;
-  uint64_t bucketMask;
-  int bucketCount;
+inline uint64_t mix(uint64_t key) {
+  // murmur3 finalizer, keys are often sequential ids
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ULL;
+  key ^= key >> 33;
+  return key;
+}
 
-  static constexpr auto initialBucketSize = 2;
-  static constexpr auto bucketSizeExpansionFactor = 2;
+inline int lowestBit(uint32_t mask) {
+#if defined(_MSC_VER)
+  unsigned long index;
+  _BitScanForward(&index, mask);
+  return (int)index;
+#else
+  return __builtin_ctz(mask);
+#endif
+}
 
-  int simpleHash(uint64_t key) const {
-    return ((uint32_t)key ^ (uint32_t)(key >> 32)) & bucketMask;
+struct Group {
+  const int8_t *ctrl;
+
+#ifdef SIMPLESET_SSE2
+  uint32_t match(int8_t h2) const {
+    __m128i g = _mm_loadu_si128((const __m128i *)ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), g));
+  }
+
+  uint32_t matchEmpty() const {
+    return match(Empty);
   }
 
-  SimpleSet(int v) {
-    int r = 0;
-    while (v >>= 1) {
-      r++;
+  uint32_t matchEmptyOrDeleted() const {
+    // both have the sign bit set, full slots don't
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+  }
+#else
+  uint32_t match(int8_t h2) const {
+    uint32_t mask = 0;
+    for(size_t i = 0; i < GroupSize; i++) {
+      mask |= uint32_t(ctrl[i] == h2) << i;
     }
+    return mask;
+  }
 
-    bucketCountBits = r;
-    bucketCount = 1 << bucketCountBits;
-    bucketMask = bucketCount - 1;
-    buckets = new Bucket *[bucketCount] { nullptr };
+  uint32_t matchEmpty() const {
+    return match(Empty);
   }
 
-  ~SimpleSet() {
-    for(int i = 0; i < bucketCount; i++) {
-      free(buckets[i]);
+  uint32_t matchEmptyOrDeleted() const {
+    uint32_t mask = 0;
+    for(size_t i = 0; i < GroupSize; i++) {
+      mask |= uint32_t(ctrl[i] < 0) << i;
     }
-    delete[] buckets;
+    return mask;
   }
+#endif
+};
+
+template <typename Slot>
+class Table {
+protected:
+  int8_t *m_ctrl = nullptr;
+  Slot *m_slots = nullptr;
+  size_t m_capacity = 0;
+  size_t m_size = 0;
+  size_t m_growthLeft = 0;
+
+  static size_t maxLoad(size_t capacity) { return capacity - capacity / 8; }
 
-  void bucketAppend(int i, uint64_t key) {
-    Bucket *cur = buckets[i];
-    if(cur == nullptr) {
-      Bucket *n = (Bucket *)malloc(sizeof(Bucket) + initialBucketSize * sizeof(uint64_t));
-      n->size = initialBucketSize;
-      n->count = 0;
-      buckets[i] = n;
-      cur = n;
-    } else if(cur->count == cur->size) {
-      int new_size = bucketSizeExpansionFactor * cur->size;
-      Bucket *n = (Bucket *)realloc(cur, sizeof(Bucket) + new_size * sizeof(uint64_t));
-      n->size = new_size;
-      buckets[i] = n;
-      cur = n;
+  size_t findIndex(uint64_t key) const {
+    if(m_capacity == 0)
+      return npos;
+
+    uint64_t h = mix(key);
+    int8_t h2 = h & 0x7F;
+    size_t groupMask = m_capacity / GroupSize - 1;
+    size_t g = (h >> 7) & groupMask;
+    for(size_t step = 1; ; step++) {
+      Group group { m_ctrl + g * GroupSize };
+      for(uint32_t mask = group.match(h2); mask != 0; mask &= mask - 1) {
+        size_t index = g * GroupSize + lowestBit(mask);
+        if(m_slots[index].first == key)
+          return index;
+      }
+      if(group.matchEmpty())
+        return npos;
+      g = (g + step) & groupMask;
     }
-    cur->data[cur->count++] = key;
   }
 
-  bool bucketContains(int i, uint64_t key) const {
-    Bucket *cur = buckets[i];
-    if(cur == nullptr) {
-      return false;
+  // Index of the first free slot on the probe sequence of key.
+  size_t findFree(uint64_t h) const {
+    size_t groupMask = m_capacity / GroupSize - 1;
+    size_t g = (h >> 7) & groupMask;
+    for(size_t step = 1; ; step++) {
+      uint32_t mask = Group { m_ctrl + g * GroupSize }.matchEmptyOrDeleted();
+      if(mask != 0)
+        return g * GroupSize + lowestBit(mask);
+      g = (g + step) & groupMask;
+    }
+  }
+
+  // Returns the slot index and whether the key was newly inserted, the slot
+  // key is set but the value is left uninitialised for new slots.
+  std::pair<size_t, bool> prepareInsert(uint64_t key) {
+    size_t index = findIndex(key);
+    if(index != npos)
+      return { index, false };
+
+    if(m_growthLeft == 0) {
+      // Drop tombstones in place when the table is mostly empty.
+      rehash(m_size * 2 < maxLoad(m_capacity) ? m_capacity : m_capacity * 2);
+    }
+
+    uint64_t h = mix(key);
+    index = findFree(h);
+    if(m_ctrl[index] == Empty) {
+      m_growthLeft--;
     }
-    for(int i = 0; i < cur->count; i++) {
-      if(cur->data[i] == key)
-        return true;
+    m_ctrl[index] = h & 0x7F;
+    m_slots[index].first = key;
+    m_size++;
+    return { index, true };
+  }
+
+  void rehash(size_t capacity) {
+    if(capacity < GroupSize) {
+      capacity = GroupSize;
     }
 
-    return false;
+    int8_t *oldCtrl = m_ctrl;
+    Slot *oldSlots = m_slots;
+    size_t oldCapacity = m_capacity;
+
+    m_ctrl = (int8_t *)std::malloc(capacity);
+    std::memset(m_ctrl, Empty, capacity);
+    m_slots = static_cast<Slot *>(::operator new(capacity * sizeof(Slot)));
+    m_capacity = capacity;
+    m_growthLeft = maxLoad(capacity) - m_size;
+
+    for(size_t i = 0; i < oldCapacity; i++) {
+      if(oldCtrl[i] >= 0) {
+        uint64_t h = mix(oldSlots[i].first);
+        size_t index = findFree(h);
+        m_ctrl[index] = h & 0x7F;
+        new (&m_slots[index]) Slot(std::move(oldSlots[i]));
+        oldSlots[i].~Slot();
+      }
+    }
+
+    std::free(oldCtrl);
+    ::operator delete(oldSlots);
   }
 
-  void insert(uint64_t key) {
-    bucketAppend(simpleHash(key), key);
+  void eraseIndex(size_t index) {
+    // A group that still has an empty slot never caused a probe to move on,
+    // so the slot can become empty again instead of a tombstone.
+    size_t g = index / GroupSize;
+    if(Group { m_ctrl + g * GroupSize }.matchEmpty()) {
+      m_ctrl[index] = Empty;
+      m_growthLeft++;
+    } else {
+      m_ctrl[index] = Deleted;
+    }
+    m_slots[index].~Slot();
+    m_size--;
   }
 
-  bool contains(uint64_t key) const {
-    return bucketContains(simpleHash(key), key);
+  void destroy() {
+    for(size_t i = 0; i < m_capacity; i++) {
+      if(m_ctrl[i] >= 0) {
+        m_slots[i].~Slot();
+      }
+    }
+    std::free(m_ctrl);
+    ::operator delete(m_slots);
+    m_ctrl = nullptr;
+    m_slots = nullptr;
+    m_capacity = m_size = m_growthLeft = 0;
   }
 
-  std::vector<uint64_t> toVector() {
-    std::vector<uint64_t> result;
+public:
+  static constexpr size_t npos = ~size_t(0);
+
+  template <typename Ref>
+  class Iterator {
+    friend class Table;
+    const Table *m_table;
+    size_t m_index;
 
-    for(int i = 0; i < bucketCount; i++) {
-      Bucket *b;
-      if((b = buckets[i]) != nullptr) {
-        for(int j = 0; j < b->count; j++) {
-          result.emplace_back(b->data[j]);
-        }
+    void skip() {
+      while(m_index < m_table->m_capacity && m_table->m_ctrl[m_index] < 0) {
+        m_index++;
       }
     }
+  public:
+    Iterator(const Table *table, size_t index) : m_table(table), m_index(index) { skip(); }
+
+    size_t index() const { return m_index; }
+
+    Ref &operator *() const { return Slot::ref(m_table->m_slots[m_index]); }
+    Ref *operator ->() const { return &Slot::ref(m_table->m_slots[m_index]); }
+    Iterator &operator ++() { m_index++; skip(); return *this; }
+    bool operator ==(const Iterator &other) const { return m_index == other.m_index; }
+    bool operator !=(const Iterator &other) const { return m_index != other.m_index; }
+  };
+
+  Table() { }
+  Table(const Table &) = delete;
+  Table &operator =(const Table &) = delete;
+
+  Table(Table &&other) {
+    operator =(std::move(other));
+  }
+
+  Table &operator =(Table &&other) {
+    if(this != &other) {
+      destroy();
+      std::swap(m_ctrl, other.m_ctrl);
+      std::swap(m_slots, other.m_slots);
+      std::swap(m_capacity, other.m_capacity);
+      std::swap(m_size, other.m_size);
+      std::swap(m_growthLeft, other.m_growthLeft);
+    }
+    return *this;
+  }
 
+  ~Table() { destroy(); }
+
+  size_t size() const { return m_size; }
+  bool empty() const { return m_size == 0; }
+  size_t capacity() const { return m_capacity; }
+
+  bool contains(uint64_t key) const { return findIndex(key) != npos; }
+
+  void reserve(size_t count) {
+    size_t capacity = GroupSize;
+    while(maxLoad(capacity) < count) {
+      capacity *= 2;
+    }
+    if(capacity > m_capacity) {
+      rehash(capacity);
+    }
+  }
+
+  bool erase(uint64_t key) {
+    size_t index = findIndex(key);
+    if(index == npos)
+      return false;
+    eraseIndex(index);
+    return true;
+  }
+
+  void clear() { destroy(); }
+};
+
+struct SetSlot {
+  uint64_t first;
+
+  static const uint64_t &ref(const SetSlot &slot) { return slot.first; }
+};
+
+template <typename V>
+struct MapSlot {
+  uint64_t first;
+  V second;
+
+  static MapSlot &ref(MapSlot &slot) { return slot; }
+};
+
+} // namespace simpleset_detail
+
+class SimpleSet : public simpleset_detail::Table<simpleset_detail::SetSlot> {
+public:
+  using iterator = Iterator<const uint64_t>;
+
+  SimpleSet(size_t expected = 0) { reserve(expected); }
+
+  // Returns true if the key wasn't part of the set yet.
+  bool insert(uint64_t key) {
+    return prepareInsert(key).second;
+  }
+
+  iterator begin() const { return { this, 0 }; }
+  iterator end() const { return { this, m_capacity }; }
+
+  std::vector<uint64_t> toVector() const {
+    std::vector<uint64_t> result;
+    result.reserve(m_size);
+    for(uint64_t key : *this) {
+      result.emplace_back(key);
+    }
     return result;
   }
 };
 
+// Iterators dereference to a pair like slot with members first and second.
+template <typename V>
+class SimpleMap : public simpleset_detail::Table<simpleset_detail::MapSlot<V>> {
+  using Base = simpleset_detail::Table<simpleset_detail::MapSlot<V>>;
+  using Base::m_slots;
+  using Base::m_capacity;
+public:
+  using iterator = typename Base::template Iterator<simpleset_detail::MapSlot<V>>;
+
+  SimpleMap(size_t expected = 0) { this->reserve(expected); }
+
+  V &operator [](uint64_t key) {
+    auto r = this->prepareInsert(key);
+    if(r.second) {
+      new (&m_slots[r.first].second) V();
+    }
+    return m_slots[r.first].second;
+  }
+
+  void insert(uint64_t key, V value) {
+    auto r = this->prepareInsert(key);
+    if(r.second) {
+      new (&m_slots[r.first].second) V(std::move(value));
+    } else {
+      m_slots[r.first].second = std::move(value);
+    }
+  }
+
+  V value(uint64_t key, const V &defaultValue = V()) const {
+    size_t index = this->findIndex(key);
+    return index == Base::npos ? defaultValue : m_slots[index].second;
+  }
+
+  iterator find(uint64_t key) const {
+    size_t index = this->findIndex(key);
+    return { this, index == Base::npos ? m_capacity : index };
+  }
+
+  void erase(const iterator &it) {
+    this->eraseIndex(it.index());
+  }
+
+  using Base::erase;
+
+  iterator begin() const { return { this, 0 }; }
+  iterator end() const { return { this, m_capacity }; }
+};
+
 #endif // SIMPLESET_H
@@ -1,7 +1,11 @@
 #include "sqlitehelper.h"
+#include "sqlitephash.h"
 #include "sqlite3.h"
 
 #include <QDebug>
+#include <QDeadlineTimer>
+#include <QFile>
+#include <QFileInfo>
 #include <QMutexLocker>
 
 void SQLitePreparedStatement::init(sqlite3 *db, const char *statement)
@@ -16,10 +20,15 @@ void SQLitePreparedStatement::init(SQLiteConnection *conn, const char *statement
   init(conn->m_db, statement);
 }
 
-void SQLitePreparedStatement::exec(const char *debug_str) const
+bool SQLitePreparedStatement::exec(const char *debug_str) const
 {
-  step(debug_str);
+  int rval = sqlite3_step(m_stmt);
+  bool ok = rval == SQLITE_ROW || rval == SQLITE_DONE;
+  if(!ok) {
+    qWarning("%s: SQLite step error: %s", debug_str, sqlite3_errmsg(sqlite3_db_handle(m_stmt)));
+  }
   reset();
+  return ok;
 }
 
 void SQLitePreparedStatement::bind(int param, const QString &text) const
@@ -43,6 +52,13 @@ void SQLitePreparedStatement::bind(int param, const QByteArray &data) const
   }
 }
 
+void SQLitePreparedStatement::bindStatic(int param, const QByteArray &data) const
+{
+  if(sqlite3_bind_blob(m_stmt, param, data.constData(), data.length(), SQLITE_STATIC) != SQLITE_OK) {
+    qWarning("SQLite bind blob error: %s", sqlite3_errmsg(sqlite3_db_handle(m_stmt)));
+  }
+}
+
 QString SQLitePreparedStatement::resultString(int index) const
 {
   return QString((const QChar *)sqlite3_column_text16(m_stmt, index));
@@ -113,6 +129,10 @@ SQLiteConnection::~SQLiteConnection()
 
 void SQLiteConnection::operator =(SQLiteConnection &&other)
 {
+  if(m_pool && m_db && m_db != other.m_db) {
+    m_pool->close(m_db);
+  }
+
   this->m_db = other.m_db;
   this->m_pool = other.m_pool;
 
@@ -153,12 +173,22 @@ SQLiteConnectionPool::~SQLiteConnectionPool() {
 SQLiteConnection SQLiteConnectionPool::open()
 {
   QMutexLocker lock(&m_mutex);
+  while(m_suspended) {
+    m_returned.wait(&m_mutex);
+  }
+
+  m_borrowed++;
   if(m_pool.isEmpty()) {
     sqlite3 *db = nullptr;
     if(sqlite3_open_v2(qUtf8Printable(m_dbname), &db, m_flags, nullptr) != SQLITE_OK) {
       qWarning("Couldn't open SQLite database: %s", sqlite3_errmsg(db));
+      // never given back, the owner only closes valid connections
+      sqlite3_close(db);
+      db = nullptr;
+      m_borrowed--;
     } else {
       qInfo("Created new connection to %s", qUtf8Printable(m_dbname));
+      registerPHashFunctions(db);
     }
     return { db, this };
   } else {
@@ -171,4 +201,53 @@ SQLiteConnection SQLiteConnectionPool::open()
 void SQLiteConnectionPool::close(sqlite3 *conn) {
   QMutexLocker lock(&m_mutex);
   m_pool.append(conn);
+  m_borrowed--;
+  m_returned.wakeAll();
+}
+
+bool SQLiteConnectionPool::replaceDatabase(const QString &path, int timeoutMs)
+{
+  QMutexLocker lock(&m_mutex);
+  m_suspended = true;
+
+  QDeadlineTimer deadline(timeoutMs);
+  while(m_borrowed > 0) {
+    if(!m_returned.wait(&m_mutex, deadline)) {
+      qWarning("%d database connections still in use, database not replaced", m_borrowed);
+      m_suspended = false;
+      m_returned.wakeAll();
+      return false;
+    }
+  }
+
+  for(auto conn : m_pool) {
+    sqlite3_close_v2(conn);
+  }
+  m_pool.clear();
+  qInfo("Closed all connections to %s", qUtf8Printable(m_dbname));
+
+  // The last connection to close checkpoints and deletes the WAL. If it's
+  // still there, the old file isn't complete without it, so keep it.
+  bool ok = QFileInfo(m_dbname + QStringLiteral("-wal")).size() == 0;
+  if(ok) {
+    QString oldPath = m_dbname + QStringLiteral(".old");
+    QFile::remove(oldPath);
+    QFile::remove(m_dbname + QStringLiteral("-wal"));
+    QFile::remove(m_dbname + QStringLiteral("-shm"));
+    ok = QFile::rename(m_dbname, oldPath);
+    if(ok && !QFile::rename(path, m_dbname)) {
+      QFile::rename(oldPath, m_dbname);
+      ok = false;
+    }
+    if(ok) {
+      QFile::remove(oldPath);
+    }
+  }
+  if(!ok) {
+    qWarning("Couldn't move %s over %s", qUtf8Printable(path), qUtf8Printable(m_dbname));
+  }
+
+  m_suspended = false;
+  m_returned.wakeAll();
+  return ok;
 }
@@ -5,6 +5,7 @@
 #include <QByteArray>
 #include <QVector>
 #include <QMutex>
+#include <QWaitCondition>
 
 struct sqlite3;
 struct sqlite3_stmt;
@@ -25,10 +26,13 @@ struct SQLitePreparedStatement {
 
   void init(sqlite3 *db, const char *statement);
   void init(SQLiteConnection *conn, const char *statement);
-  void exec(const char *debug_str = nullptr) const; // step + reset
+  bool exec(const char *debug_str = nullptr) const; // step + reset, false on error
   void bind(int param, const QString &text) const;
   void bind(int param, qint64 value) const ;
   void bind(int param, const QByteArray &data) const;
+  // No copy, data must stay valid until the parameter is bound again or the
+  // statement is destroyed.
+  void bindStatic(int param, const QByteArray &data) const;
   QString resultString(int index) const;
   qint64 resultInteger(int index) const;
 
@@ -76,11 +80,19 @@ struct SQLiteConnection {
   void operator = (SQLiteConnection &&other);
 };
 
+// Hands out connections to the database file and takes them back for reuse.
+// replaceDatabase() swaps the file underneath the pool: new connections are
+// held back until every borrowed one came back, then all of them are closed
+// and the file is replaced. Owners of long-lived connections have to give
+// them back and open new ones afterwards.
 struct SQLiteConnectionPool {
   QVector<sqlite3 *> m_pool;
   QString m_dbname;
   int m_flags;
   QMutex m_mutex;
+  QWaitCondition m_returned;
+  int m_borrowed = 0;
+  bool m_suspended = false;
   QMutex m_writeLock;
 
   SQLiteConnectionPool(const QString &dbname, int flags);
@@ -92,6 +104,9 @@ struct SQLiteConnectionPool {
 
   SQLiteConnection open();
   void close(sqlite3 *conn);
+  // Moves path over the database file. Gives up when borrowed connections
+  // don't come back within timeoutMs, the old file stays in use then.
+  bool replaceDatabase(const QString &path, int timeoutMs);
 };
 
 #endif // SQLITEHELPER_H
@@ -0,0 +1,355 @@
+#include "sqlitephash.h"
+#include "sqlite3.h"
+
+#include <QDebug>
+#include <QReadWriteLock>
+#include <QSet>
+
+#include <new>
+
+namespace {
+
+enum Column {
+  COL_ID,
+  COL_PHASH,
+  COL_DISTANCE,
+  COL_QUERY_HASH,
+  COL_MAX_DISTANCE,
+};
+
+enum Plan {
+  PLAN_QUERY_HASH = 0x01,
+  PLAN_MAX_DISTANCE = 0x02,
+  PLAN_DISTANCE_LE = 0x04,
+  PLAN_DISTANCE_LT = 0x08,
+  PLAN_DISTANCE_EQ = 0x10,
+};
+
+const int defaultMaxDistance = 8;
+
+struct PHashNearTable {
+  sqlite3_vtab base;
+  sqlite3 *db;
+};
+
+// The ids guard against inserting an image twice, when the writer reports a
+// commit that the initial load already saw.
+struct SharedIndex {
+  QReadWriteLock lock;
+  PHashIndex index;
+  QSet<qint64> ids;
+  bool loaded = false;
+};
+
+SharedIndex &sharedIndex()
+{
+  static SharedIndex shared;
+  return shared;
+}
+
+struct PHashNearCursor {
+  sqlite3_vtab_cursor base;
+  std::vector<PHashIndex::Match> matches;
+  size_t pos = 0;
+  sqlite3_int64 queryHash = 0;
+  int maxDistance = 0;
+};
+
+// Loads the shared index once, later changes arrive through
+// phashIndexInsert() and phashIndexRemove().
+static int refreshIndex(sqlite3 *db)
+{
+  SharedIndex &shared = sharedIndex();
+  {
+    QReadLocker lock(&shared.lock);
+    if(shared.loaded)
+      return SQLITE_OK;
+  }
+
+  QWriteLocker lock(&shared.lock);
+  if(shared.loaded)
+    return SQLITE_OK;
+
+  sqlite3_stmt *stmt = nullptr;
+  if(sqlite3_prepare_v2(db, "SELECT id, phash FROM image WHERE phash IS NOT NULL", -1, &stmt, nullptr) != SQLITE_OK)
+    return SQLITE_ERROR;
+  while(sqlite3_step(stmt) == SQLITE_ROW) {
+    sqlite3_int64 id = sqlite3_column_int64(stmt, 0);
+    if(!shared.ids.contains(id)) {
+      shared.ids.insert(id);
+      shared.index.insert(id, sqlite3_column_int64(stmt, 1));
+    }
+  }
+  int rc = sqlite3_finalize(stmt);
+
+  if(rc == SQLITE_OK) {
+    shared.index.build();
+    shared.loaded = true;
+    qInfo("Loaded phash index of %d images", (int)shared.index.size());
+  } else {
+    shared.index.clear();
+    shared.ids.clear();
+  }
+  return rc;
+}
+
+static int queryIndex(sqlite3 *db, uint64_t hash, int k, int maxDistance, std::vector<PHashIndex::Match> *matches)
+{
+  int rc = refreshIndex(db);
+  if(rc != SQLITE_OK)
+    return rc;
+
+  SharedIndex &shared = sharedIndex();
+  QReadLocker lock(&shared.lock);
+  *matches = shared.index.query(hash, k, maxDistance);
+  return SQLITE_OK;
+}
+
+int nearConnect(sqlite3 *db, void *, int, const char *const *, sqlite3_vtab **ppVtab, char **)
+{
+  int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(id INTEGER, phash INTEGER, distance INTEGER, query_hash HIDDEN, max_distance HIDDEN)");
+  if(rc != SQLITE_OK)
+    return rc;
+
+  auto table = new (std::nothrow) PHashNearTable();
+  if(table == nullptr)
+    return SQLITE_NOMEM;
+
+  table->db = db;
+  *ppVtab = &table->base;
+  return SQLITE_OK;
+}
+
+int nearDisconnect(sqlite3_vtab *pVtab)
+{
+  delete reinterpret_cast<PHashNearTable *>(pVtab);
+  return SQLITE_OK;
+}
+
+int nearBestIndex(sqlite3_vtab *, sqlite3_index_info *info)
+{
+  int plan = 0;
+  int argv[5] = { -1, -1, -1, -1, -1 };
+  int slots[5] = { PLAN_QUERY_HASH, PLAN_MAX_DISTANCE, PLAN_DISTANCE_LE, PLAN_DISTANCE_LT, PLAN_DISTANCE_EQ };
+
+  for(int i = 0; i < info->nConstraint; i++) {
+    const auto &c = info->aConstraint[i];
+    if(!c.usable)
+      continue;
+
+    int slot = -1;
+    if(c.iColumn == COL_QUERY_HASH && c.op == SQLITE_INDEX_CONSTRAINT_EQ) {
+      slot = 0;
+    } else if(c.iColumn == COL_MAX_DISTANCE && c.op == SQLITE_INDEX_CONSTRAINT_EQ) {
+      slot = 1;
+    } else if(c.iColumn == COL_DISTANCE && c.op == SQLITE_INDEX_CONSTRAINT_LE) {
+      slot = 2;
+    } else if(c.iColumn == COL_DISTANCE && c.op == SQLITE_INDEX_CONSTRAINT_LT) {
+      slot = 3;
+    } else if(c.iColumn == COL_DISTANCE && c.op == SQLITE_INDEX_CONSTRAINT_EQ) {
+      slot = 4;
+    }
+
+    if(slot >= 0 && argv[slot] < 0) {
+      argv[slot] = i;
+      plan |= slots[slot];
+    }
+  }
+
+  if(!(plan & PLAN_QUERY_HASH)) {
+    // Unusable without a query hash, make sure the planner looks elsewhere.
+    info->estimatedCost = 1e99;
+    info->estimatedRows = 1000000000;
+    return SQLITE_OK;
+  }
+
+  int argvIndex = 1;
+  for(int slot = 0; slot < 5; slot++) {
+    if(argv[slot] >= 0) {
+      info->aConstraintUsage[argv[slot]].argvIndex = argvIndex++;
+      // The hidden columns are arguments, the distance is still checked by SQLite.
+      info->aConstraintUsage[argv[slot]].omit = slot < 2;
+    }
+  }
+
+  if(info->nOrderBy == 1 && info->aOrderBy[0].iColumn == COL_DISTANCE && !info->aOrderBy[0].desc) {
+    info->orderByConsumed = 1;
+  }
+
+  info->idxNum = plan;
+  info->estimatedCost = 100;
+  info->estimatedRows = 50;
+  return SQLITE_OK;
+}
+
+int nearOpen(sqlite3_vtab *, sqlite3_vtab_cursor **ppCursor)
+{
+  auto cursor = new (std::nothrow) PHashNearCursor();
+  if(cursor == nullptr)
+    return SQLITE_NOMEM;
+
+  *ppCursor = &cursor->base;
+  return SQLITE_OK;
+}
+
+int nearClose(sqlite3_vtab_cursor *cur)
+{
+  delete reinterpret_cast<PHashNearCursor *>(cur);
+  return SQLITE_OK;
+}
+
+int nearFilter(sqlite3_vtab_cursor *cur, int idxNum, const char *, int argc, sqlite3_value **argv)
+{
+  auto cursor = reinterpret_cast<PHashNearCursor *>(cur);
+  auto table = reinterpret_cast<PHashNearTable *>(cur->pVtab);
+
+  cursor->matches.clear();
+  cursor->pos = 0;
+
+  if(!(idxNum & PLAN_QUERY_HASH) || argc < 1) {
+    sqlite3_free(table->base.zErrMsg);
+    table->base.zErrMsg = sqlite3_mprintf("phash_near requires a query hash");
+    return SQLITE_ERROR;
+  }
+
+  int arg = 0;
+  if(sqlite3_value_type(argv[arg]) == SQLITE_NULL)
+    return SQLITE_OK;
+  cursor->queryHash = sqlite3_value_int64(argv[arg++]);
+
+  int maxDistance = (idxNum & PLAN_MAX_DISTANCE) ? sqlite3_value_int(argv[arg++]) : defaultMaxDistance;
+  if(idxNum & PLAN_DISTANCE_LE) {
+    int d = sqlite3_value_int(argv[arg++]);
+    if(!(idxNum & PLAN_MAX_DISTANCE) || d < maxDistance) maxDistance = d;
+  }
+  if(idxNum & PLAN_DISTANCE_LT) {
+    int d = sqlite3_value_int(argv[arg++]) - 1;
+    if(!(idxNum & (PLAN_MAX_DISTANCE | PLAN_DISTANCE_LE)) || d < maxDistance) maxDistance = d;
+  }
+  if(idxNum & PLAN_DISTANCE_EQ) {
+    int d = sqlite3_value_int(argv[arg++]);
+    if(!(idxNum & (PLAN_MAX_DISTANCE | PLAN_DISTANCE_LE | PLAN_DISTANCE_LT)) || d < maxDistance) maxDistance = d;
+  }
+  cursor->maxDistance = maxDistance;
+
+  if(maxDistance < 0)
+    return SQLITE_OK;
+
+  return queryIndex(table->db, cursor->queryHash, -1, maxDistance, &cursor->matches);
+}
+
+int nearNext(sqlite3_vtab_cursor *cur)
+{
+  reinterpret_cast<PHashNearCursor *>(cur)->pos++;
+  return SQLITE_OK;
+}
+
+int nearEof(sqlite3_vtab_cursor *cur)
+{
+  auto cursor = reinterpret_cast<PHashNearCursor *>(cur);
+  return cursor->pos >= cursor->matches.size();
+}
+
+int nearColumn(sqlite3_vtab_cursor *cur, sqlite3_context *ctx, int column)
+{
+  auto cursor = reinterpret_cast<PHashNearCursor *>(cur);
+  const auto &match = cursor->matches[cursor->pos];
+  switch(column) {
+  case COL_ID: sqlite3_result_int64(ctx, match.id); break;
+  case COL_PHASH: sqlite3_result_int64(ctx, match.hash); break;
+  case COL_DISTANCE: sqlite3_result_int(ctx, match.distance); break;
+  case COL_QUERY_HASH: sqlite3_result_int64(ctx, cursor->queryHash); break;
+  case COL_MAX_DISTANCE: sqlite3_result_int(ctx, cursor->maxDistance); break;
+  }
+  return SQLITE_OK;
+}
+
+int nearRowid(sqlite3_vtab_cursor *cur, sqlite3_int64 *pRowid)
+{
+  auto cursor = reinterpret_cast<PHashNearCursor *>(cur);
+  *pRowid = cursor->matches[cursor->pos].id;
+  return SQLITE_OK;
+}
+
+sqlite3_module phashNearModule = {
+  0,                /* iVersion */
+  nullptr,          /* xCreate, eponymous only */
+  nearConnect,
+  nearBestIndex,
+  nearDisconnect,
+  nullptr,          /* xDestroy */
+  nearOpen,
+  nearClose,
+  nearFilter,
+  nearNext,
+  nearEof,
+  nearColumn,
+  nearRowid,
+  nullptr,          /* xUpdate */
+  nullptr,          /* xBegin */
+  nullptr,          /* xSync */
+  nullptr,          /* xCommit */
+  nullptr,          /* xRollback */
+  nullptr,          /* xFindFunction */
+  nullptr,          /* xRename */
+  nullptr,          /* xSavepoint */
+  nullptr,          /* xRelease */
+  nullptr,          /* xRollbackTo */
+  nullptr,          /* xShadowName */
+};
+
+void hammingFunc(sqlite3_context *ctx, int, sqlite3_value **argv)
+{
+  if(sqlite3_value_type(argv[0]) == SQLITE_NULL || sqlite3_value_type(argv[1]) == SQLITE_NULL) {
+    sqlite3_result_null(ctx);
+    return;
+  }
+
+  sqlite3_result_int(ctx, PHashIndex::distance(sqlite3_value_int64(argv[0]), sqlite3_value_int64(argv[1])));
+}
+
+} // namespace
+
+void registerPHashFunctions(sqlite3 *db)
+{
+  if(sqlite3_create_function(db, "hamming", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC, nullptr, hammingFunc, nullptr, nullptr) != SQLITE_OK) {
+    qWarning("Failed to register hamming(): %s", sqlite3_errmsg(db));
+  }
+
+  if(sqlite3_create_module(db, "phash_near", &phashNearModule, nullptr) != SQLITE_OK) {
+    qWarning("Failed to register phash_near: %s", sqlite3_errmsg(db));
+  }
+}
+
+std::vector<PHashIndex::Match> phashIndexQuery(sqlite3 *db, uint64_t hash, int k, int maxDistance)
+{
+  std::vector<PHashIndex::Match> matches;
+  if(queryIndex(db, hash, k, maxDistance, &matches) != SQLITE_OK) {
+    qWarning("Failed to load phash index: %s", sqlite3_errmsg(db));
+  }
+  return matches;
+}
+
+// Not loaded yet, the load will see the committed change.
+void phashIndexInsert(int64_t id, uint64_t hash)
+{
+  SharedIndex &shared = sharedIndex();
+  QWriteLocker lock(&shared.lock);
+  if(shared.loaded && !shared.ids.contains(id)) {
+    shared.ids.insert(id);
+    shared.index.insert(id, hash);
+  }
+}
+
+void phashIndexRemove(const std::vector<int64_t> &ids)
+{
+  SharedIndex &shared = sharedIndex();
+  QWriteLocker lock(&shared.lock);
+  if(!shared.loaded)
+    return;
+
+  for(int64_t id : ids) {
+    shared.ids.remove(id);
+  }
+  shared.index.remove(ids);
+}
@@ -0,0 +1,26 @@
+#ifndef SQLITEPHASH_H
+#define SQLITEPHASH_H
+
+#include "phashindex.h"
+
+struct sqlite3;
+
+// Registers hamming(a, b) and the phash_near table valued function on a
+// connection:
+//
+//   SELECT id, distance FROM phash_near(?1, 6) JOIN tag USING (id)
+//   SELECT id FROM phash_near WHERE query_hash = ?1 AND distance <= 6
+//
+// phash_near returns the images within max_distance (default 8) of
+// query_hash, nearest first.
+void registerPHashFunctions(sqlite3 *db);
+
+// phash_near answers from one index shared by all connections. It's loaded
+// from the image table on first use, through whichever connection asks
+// first, and then kept current by the writer which reports its changes once
+// they are committed. Thread safe.
+std::vector<PHashIndex::Match> phashIndexQuery(sqlite3 *db, uint64_t hash, int k, int maxDistance);
+void phashIndexInsert(int64_t id, uint64_t hash);
+void phashIndexRemove(const std::vector<int64_t> &ids);
+
+#endif // SQLITEPHASH_H